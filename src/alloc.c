@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "libchannel.h"
+#include "alloc.h"
+
+/*
+ * Constants: slab geometry
+ * ------------------------
+ * SLAB_CLASSES is the number of size classes, listed in 'class_size': powers of two
+ * up to 128 bytes, then powers of two and their midpoints, so that a channel whose
+ * ring is a power of two does not waste half a block on its header. Every class
+ * from 64 bytes up is a multiple of a cache line. SLAB_BLOCK is the size of the
+ * blocks carved into objects (at least SLAB_BLOCK_OBJS objects each), MAG_MAX the
+ * number of free objects a thread keeps per class before giving half of them back.
+ */
+#define SLAB_CLASSES    22
+#define SLAB_BLOCK      65536
+#define SLAB_BLOCK_OBJS 4
+#define MAG_MAX         32
+
+static const size_t class_size[SLAB_CLASSES] = {
+    16, 32, 64, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+    3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768, 49152, 65536
+};
+
+/*
+ * `lc_class_t` is the shared free list of a size class, linked through the first word
+ * of each object.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    void           *free;
+    size_t          nfree;
+} lc_class_t;
+
+/*
+ * `lc_tcache_t` holds the free objects a thread keeps, per size class.
+ */
+typedef struct {
+    void   *head[SLAB_CLASSES];
+    size_t  count[SLAB_CLASSES];
+} lc_tcache_t;
+
+static lc_class_t classes[SLAB_CLASSES] = {
+    [0 ... SLAB_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+static __thread lc_tcache_t *tcache = NULL;
+static pthread_key_t  tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+static void *default_alloc(size_t size, size_t align, void *ctx) {
+    void *ptr;
+    return posix_memalign(&ptr, align, size) == 0 ? ptr : NULL;
+}
+
+static void default_free(void *ptr, size_t size, void *ctx) {
+    free(ptr);
+}
+
+/*
+ * Variables: allocator, allocator_used
+ * ------------------------------------
+ * The allocator behind the slabs, and whether it was called yet: past that point it
+ * can no longer be replaced, as blocks must go back to the allocator they came from.
+ */
+static lc_allocator_t allocator = { default_alloc, default_free, NULL };
+static atomic_int allocator_used;
+
+static void *backend_alloc(size_t size) {
+    atomic_store_explicit(&allocator_used, 1, memory_order_relaxed);
+    return allocator.alloc(size, 64, allocator.ctx);
+}
+
+static void backend_free(void *ptr, size_t size) {
+    allocator.free(ptr, size, allocator.ctx);
+}
+
+/*
+ * Function: libchannel_set_allocator
+ * ----------------------------------
+ * Replaces the allocator behind the memory of channels, buffers and wait nodes, or
+ * restores the default one if 'a' is NULL. Must be called before the library
+ * allocates anything, that is before init_libchannel_prewarm or the first channel.
+ *
+ * Returns: 0 on success, -1 if the library already allocated memory or 'a' lacks a
+ * function.
+ */
+int libchannel_set_allocator(const lc_allocator_t *a) {
+    if (atomic_load(&allocator_used) || (a && (!a->alloc || !a->free)))
+        return -1;
+    if (a) {
+        allocator = *a;
+    } else {
+        allocator.alloc = default_alloc;
+        allocator.free = default_free;
+        allocator.ctx = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Function: size_class
+ * --------------------
+ * Returns the smallest size class that holds 'size' bytes, which must not exceed
+ * LC_SLAB_MAX.
+ */
+static int size_class(size_t size) {
+    int c = 0;
+    while (class_size[c] < size)
+        c++;
+    return c;
+}
+
+/*
+ * Function: class_carve
+ * ---------------------
+ * Allocates a block and pushes its objects on the free list of a class. Called with
+ * the class locked.
+ *
+ * Returns: 0 on success, -1 if memory runs out.
+ */
+static int class_carve(lc_class_t *cls, size_t size) {
+    size_t bytes = size * SLAB_BLOCK_OBJS > SLAB_BLOCK ? size * SLAB_BLOCK_OBJS : SLAB_BLOCK;
+    char *block = backend_alloc(bytes);
+    size_t off;
+
+    if (!block)
+        return -1;
+    for (off = 0; off + size <= bytes; off += size) {
+        *(void **)(block + off) = cls->free;
+        cls->free = block + off;
+        cls->nfree++;
+    }
+    return 0;
+}
+
+/*
+ * Function: class_take
+ * --------------------
+ * Moves up to 'max' objects of a class from its free list to 'list', carving a new
+ * block if the free list is empty.
+ *
+ * Returns: the number of objects moved, 0 if memory runs out.
+ */
+static size_t class_take(int c, void **list, size_t max) {
+    lc_class_t *cls = &classes[c];
+    size_t n = 0;
+    void *obj;
+
+    pthread_mutex_lock(&(cls->mutex));
+    if (cls->nfree > 0 || class_carve(cls, class_size[c]) == 0) {
+        while (n < max && (obj = cls->free) != NULL) {
+            cls->free = *(void **)obj;
+            cls->nfree--;
+            *(void **)obj = *list;
+            *list = obj;
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&(cls->mutex));
+    return n;
+}
+
+/*
+ * Function: class_give
+ * --------------------
+ * Moves 'n' objects from the head of 'list' to the free list of their class.
+ */
+static void class_give(int c, void **list, size_t n) {
+    lc_class_t *cls = &classes[c];
+    void *obj;
+
+    pthread_mutex_lock(&(cls->mutex));
+    while (n-- > 0 && (obj = *list) != NULL) {
+        *list = *(void **)obj;
+        *(void **)obj = cls->free;
+        cls->free = obj;
+        cls->nfree++;
+    }
+    pthread_mutex_unlock(&(cls->mutex));
+}
+
+/*
+ * Function: free_tcache
+ * ---------------------
+ * Thread-specific data destructor that gives the cached objects of an exiting thread
+ * back to their classes.
+ */
+static void free_tcache(void *value) {
+    lc_tcache_t *cache = value;
+    int c;
+
+    for (c = 0; c < SLAB_CLASSES; c++)
+        class_give(c, &(cache->head[c]), cache->count[c]);
+    tcache = NULL;
+    backend_free(cache, sizeof(lc_tcache_t));
+}
+
+static void make_tcache_key(void) {
+    pthread_key_create(&tcache_key, free_tcache);
+}
+
+/*
+ * Function: get_tcache
+ * --------------------
+ * Returns the cache of the calling thread, creating it on first use, or NULL if
+ * memory runs out (the caller then uses the shared free lists directly).
+ */
+static lc_tcache_t *get_tcache(void) {
+    if (!tcache) {
+        pthread_once(&tcache_once, make_tcache_key);
+        if ((tcache = backend_alloc(sizeof(lc_tcache_t))) != NULL) {
+            memset(tcache, 0, sizeof(lc_tcache_t));
+            pthread_setspecific(tcache_key, tcache);
+        }
+    }
+    return tcache;
+}
+
+void *lc_alloc(size_t size) {
+    lc_tcache_t *cache;
+    void *obj = NULL;
+    int c;
+
+    if (size > LC_SLAB_MAX)
+        return backend_alloc(size);
+    c = size_class(size ? size : 1);
+    if (!(cache = get_tcache())) {
+        class_take(c, &obj, 1);
+        return obj;
+    }
+    if (!cache->head[c])
+        cache->count[c] += class_take(c, &(cache->head[c]), MAG_MAX / 2);
+    if ((obj = cache->head[c]) != NULL) {
+        cache->head[c] = *(void **)obj;
+        cache->count[c]--;
+    }
+    return obj;
+}
+
+void *lc_calloc(size_t size) {
+    void *ptr = lc_alloc(size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+void lc_free(void *ptr, size_t size) {
+    lc_tcache_t *cache;
+    int c;
+
+    if (!ptr)
+        return;
+    if (size > LC_SLAB_MAX) {
+        backend_free(ptr, size);
+        return;
+    }
+    c = size_class(size ? size : 1);
+    if (!(cache = get_tcache())) {
+        *(void **)ptr = NULL;
+        class_give(c, &ptr, 1);
+        return;
+    }
+    *(void **)ptr = cache->head[c];
+    cache->head[c] = ptr;
+    if (++cache->count[c] > MAG_MAX) {
+        class_give(c, &(cache->head[c]), MAG_MAX / 2);
+        cache->count[c] -= MAG_MAX / 2;
+    }
+}
+
+int lc_prewarm(size_t size, size_t count) {
+    lc_class_t *cls;
+    int ret = 0;
+    int c;
+
+    if (size > LC_SLAB_MAX)
+        return 0;
+    c = size_class(size ? size : 1);
+    cls = &classes[c];
+    pthread_mutex_lock(&(cls->mutex));
+    while (ret == 0 && cls->nfree < count)
+        ret = class_carve(cls, class_size[c]);
+    pthread_mutex_unlock(&(cls->mutex));
+    return ret;
+}
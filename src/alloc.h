@@ -0,0 +1,68 @@
+/*
+ * File: alloc.h
+ * ----------------------------
+ * This header file includes the memory allocator of the library, used for channels,
+ * their buffers, wait queue nodes and condition variables.
+ *
+ * Requests up to LC_SLAB_MAX bytes are served from slabs: per size class (powers of
+ * two from LC_SLAB_MIN bytes), objects are carved out of large blocks obtained from
+ * the allocator set with libchannel_set_allocator (posix_memalign/free by default).
+ * Freed objects go to a small cache of the calling thread, and move to and from the
+ * shared free list of their class in batches, so a steady state makes no allocator
+ * call and rarely takes a lock. Slab blocks are never returned to the allocator.
+ * Larger requests go straight to the allocator.
+ *
+ * Every block is aligned on a cache line, or on its size class if that is smaller,
+ * and must be freed with the size it was allocated with.
+ *
+ * Functions:
+ * lc_alloc: Allocates a block.
+ * lc_calloc: Allocates a zeroed block.
+ * lc_free: Frees a block.
+ * lc_prewarm: Fills the free list of a size class ahead of use.
+ */
+#ifndef _LC_ALLOC_H
+#define _LC_ALLOC_H 1
+
+#include <stddef.h>
+
+#define LC_SLAB_MIN   16
+#define LC_SLAB_MAX   65536
+
+/*
+ * Function: lc_alloc
+ * ------------------
+ * Allocates a block of 'size' bytes, not initialized.
+ *
+ * Returns: the block, or NULL if memory runs out.
+ */
+extern void *lc_alloc(size_t size);
+
+/*
+ * Function: lc_calloc
+ * -------------------
+ * Allocates a block of 'size' bytes, set to zero.
+ *
+ * Returns: the block, or NULL if memory runs out.
+ */
+extern void *lc_calloc(size_t size);
+
+/*
+ * Function: lc_free
+ * -----------------
+ * Frees a block allocated with lc_alloc or lc_calloc with the same 'size'. A NULL
+ * block is ignored.
+ */
+extern void lc_free(void *ptr, size_t size);
+
+/*
+ * Function: lc_prewarm
+ * --------------------
+ * Makes sure that 'count' blocks of 'size' bytes can be allocated without calling
+ * the allocator. Does nothing for sizes beyond LC_SLAB_MAX.
+ *
+ * Returns: 0 on success, -1 if memory runs out.
+ */
+extern int lc_prewarm(size_t size, size_t count);
+
+#endif
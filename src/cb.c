@@ -1,47 +1,687 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include "cb.h"
+#include "alloc.h"
 
 
+// `ring_wrap` maps 'i', lower than twice the size of a ring, to its slot: with the mask
+// when the size is a power of two, with a compare otherwise, never with a division.
+static inline size_t ring_wrap(size_t i, size_t size, size_t mask) {
+    if (mask)
+        return i & mask;
+    return i >= size ? i - size : i;
+}
+
+// `len_add` moves the length of a buffer by 'delta'. Writers hold the channel lock, but
+// len(), cb_can_* and the inline chan_try_* functions read 'len' without it, so it is
+// stored atomically.
+static inline void len_add(cbuff_t *cb, long delta) {
+    __atomic_store_n(&(cb->len), cb->len + delta, __ATOMIC_RELAXED);
+}
+
+// `ring_mask` returns the mask of a ring of a given size, or 0 if the size is not a
+// power of two (a ring of one slot needs no wrapping either).
+static size_t ring_mask(size_t size) {
+    return (size > 1 && (size & (size - 1)) == 0) ? size - 1 : 0;
+}
+
+// `cb_alloc_bytes` allocates a zeroed buffer header followed by 'extra' bytes, aligned
+// on a cache line as the field groups of `cbuff_t` require. Returns NULL on failure.
+static cbuff_t *cb_alloc_bytes(size_t extra) {
+    cbuff_t *ptr;
+
+    if (extra > SIZE_MAX - sizeof(cbuff_t) || !(ptr = lc_calloc(sizeof(cbuff_t) + extra)))
+        return NULL;
+    ptr->alloc_bytes = sizeof(cbuff_t) + extra;
+    return ptr;
+}
+
+// `cb_alloc` allocates a zeroed buffer header followed by 'size' slots.
+// Returns NULL on failure.
+static cbuff_t *cb_alloc(size_t size) {
+    if (cb_footprint(size) == 0)
+        return NULL;
+    return cb_alloc_bytes(size * sizeof(any_t));
+}
+
+// `cb_footprint` returns the number of bytes cb_init_at needs for a CB_RING buffer of
+// a given size: the header followed by the slots. Returns 0 if it overflows.
+size_t cb_footprint(size_t size) {
+    if (size > (SIZE_MAX - sizeof(cbuff_t)) / sizeof(any_t))
+        return 0;
+    return sizeof(cbuff_t) + size * sizeof(any_t);
+}
+
+// `cb_init_at` function initializes a CB_RING buffer of a given size in 'mem', which
+// holds cb_footprint(size) zeroed bytes aligned on a cache line.
+cbuff_t *cb_init_at(void *mem, size_t size) {
+    cbuff_t *ptr = mem;
+    ptr->buff = ptr->slots;
+    ptr->size = size;
+    ptr->mask = ring_mask(size);
+    ptr->cap = size;
+    ptr->embedded = 1;
+    return ptr;
+}
+
 // `cb_init` function initializes a new circular buffer of a given size.
 // Returns a pointer to the created buffer on success, NULL on failure.
 cbuff_t *cb_init(size_t size) {
-    cbuff_t *ptr = calloc(1, sizeof(cbuff_t));
+    cbuff_t *ptr = cb_alloc(size);
+    if (ptr) {
+        cb_init_at(ptr, size);
+        ptr->embedded = 0;
+    }
+    return ptr;
+}
+
+// `cb_init_spill` function initializes a circular buffer of a given size that overflows
+// into a spill segment of at most max_bytes, in an unnamed file of the directory dir.
+// Returns a pointer to the created buffer on success, NULL on failure.
+cbuff_t *cb_init_spill(size_t size, const char *dir, size_t max_bytes) {
+    cbuff_t *ptr = cb_init(size);
     if (ptr) {
-        ptr->buff = calloc(size, sizeof(any_t));
-        if (ptr->buff) {
-            ptr->cap = size;
+        ptr->spill = spill_open(dir, max_bytes);
+        if (ptr->spill) {
+            ptr->cap += ptr->spill->cap;
             return ptr;
         }
-        free(ptr);
+        cb_free(&ptr);
+    }
+    return NULL;
+}
+
+// `cb_init_chunked` function initializes a new unbounded buffer made of chunks.
+// Returns a pointer to the created buffer on success, NULL on failure.
+cbuff_t *cb_init_chunked(void) {
+    cbuff_t *ptr = cb_alloc(0);
+    if (ptr) {
+        ptr->kind = CB_CHUNKED;
+        ptr->cap = SIZE_MAX;
+    }
+    return ptr;
+}
+
+// `chunk_get` returns a chunk from the free list of the buffer, or a new one.
+static cb_chunk_t *chunk_get(cbuff_t *cb) {
+    cb_chunk_t *chunk = cb->free;
+    if (chunk) {
+        cb->free = chunk->next;
+        cb->nfree--;
+    } else if (!(chunk = lc_alloc(sizeof(cb_chunk_t)))) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    return chunk;
+}
+
+// `chunk_put` keeps a drained chunk in the free list of the buffer, or frees it
+// if the list is already full.
+static void chunk_put(cbuff_t *cb, cb_chunk_t *chunk) {
+    if (cb->nfree < CB_FREE_CHUNKS) {
+        chunk->next = cb->free;
+        cb->free = chunk;
+        cb->nfree++;
+    } else {
+        lc_free(chunk, sizeof(cb_chunk_t));
+    }
+}
+
+static void chunk_free_list(cb_chunk_t *chunk) {
+    cb_chunk_t *next;
+    for (; chunk; chunk = next) {
+        next = chunk->next;
+        lc_free(chunk, sizeof(cb_chunk_t));
+    }
+}
+
+// `chunked_write` appends data at the tail chunk, linking a new chunk when it is full.
+static int chunked_write(cbuff_t *cb, any_t data) {
+    cb_chunk_t *chunk;
+
+    if (!cb->tail || cb->end == CB_CHUNK_SIZE) {
+        if (!(chunk = chunk_get(cb)))
+            return 0;
+        if (cb->tail)
+            cb->tail->next = chunk;
+        else
+            cb->head = chunk;
+        cb->tail = chunk;
+        cb->end = 0;
+    }
+    cb->tail->vals[cb->end++] = data;
+    len_add(cb, 1);
+    return 1;
+}
+
+// `chunked_read` removes data from the head chunk, recycling the chunk once drained.
+static int chunked_read(cbuff_t *cb, any_t *data) {
+    cb_chunk_t *chunk = cb->head;
+
+    if (cb->len == 0)
+        return 0;
+    *data = chunk->vals[cb->start++];
+    len_add(cb, -1);
+
+    if (cb->len == 0) {
+        // The head is the last chunk: keep it and start over at its beginning
+        cb->start = 0;
+        cb->end = 0;
+    } else if (cb->start == CB_CHUNK_SIZE) {
+        cb->head = chunk->next;
+        cb->start = 0;
+        chunk_put(cb, chunk);
+    }
+    return 1;
+}
+
+// `cb_init_keyed` function initializes a new conflating buffer of a given size.
+// Returns a pointer to the created buffer on success, NULL on failure.
+cbuff_t *cb_init_keyed(size_t size) {
+    cbuff_t *ptr = cb_init(size);
+    size_t icap = 2;
+
+    if (!ptr)
+        return NULL;
+    // Keep the index at most half full
+    while (icap < 2 * size)
+        icap <<= 1;
+    ptr->kind = CB_KEYED;
+    ptr->keys = lc_alloc(size * sizeof(uint64_t));
+    ptr->index = lc_calloc(icap * sizeof(uint32_t));
+    ptr->imask = icap - 1;
+    if (!ptr->keys || !ptr->index)
+        cb_free(&ptr);
+    return ptr;
+}
+
+// `key_hash` returns the home entry of a key in the index of a CB_KEYED buffer.
+static size_t key_hash(cbuff_t *cb, uint64_t key) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & cb->imask;
+}
+
+// `keyed_write` replaces the pending value with the same key in place, or appends
+// the value at the end of the buffer and indexes its slot.
+static int keyed_write(cbuff_t *cb, any_t data, uint64_t key) {
+    size_t h = key_hash(cb, key);
+    uint32_t slot;
+
+    for (; cb->index[h]; h = (h + 1) & cb->imask) {
+        slot = cb->index[h] - 1;
+        if (cb->keys[slot] == key) {
+            cb->buff[slot] = data;
+            cb->dropped++;
+            return 1;
+        }
+    }
+    if (cb->len == cb->cap)
+        return 0;
+
+    cb->buff[cb->end] = data;
+    cb->keys[cb->end] = key;
+    cb->index[h] = cb->end + 1;
+    cb->end = (int)ring_wrap(cb->end + 1, cb->size, cb->mask);
+    len_add(cb, 1);
+    return 1;
+}
+
+// `keyed_read` removes the oldest pending value and its entry in the index. The
+// entries that follow in the same probe run are shifted back to fill the hole.
+static int keyed_read(cbuff_t *cb, any_t *data, uint64_t *key) {
+    size_t i, j, home;
+
+    if (cb->len == 0)
+        return 0;
+    *data = cb->buff[cb->start];
+    if (key)
+        *key = cb->keys[cb->start];
+
+    for (i = key_hash(cb, cb->keys[cb->start]); cb->index[i] != cb->start + 1; i = (i + 1) & cb->imask)
+        ;
+    cb->index[i] = 0;
+    for (j = (i + 1) & cb->imask; cb->index[j]; j = (j + 1) & cb->imask) {
+        home = key_hash(cb, cb->keys[cb->index[j] - 1]);
+        // The entry stays if its home lies cyclically in (i, j]
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        cb->index[i] = cb->index[j];
+        cb->index[j] = 0;
+        i = j;
+    }
+
+    cb->start = (int)ring_wrap(cb->start + 1, cb->size, cb->mask);
+    len_add(cb, -1);
+    return 1;
+}
+
+// `cb_init_typed` function initializes a buffer of 'size' elements of 'elem_size' bytes.
+// Returns a pointer to the created buffer on success, NULL on failure.
+cbuff_t *cb_init_typed(size_t size, size_t elem_size) {
+    cbuff_t *ptr;
+
+    if (elem_size == 0 || size > SIZE_MAX / elem_size || !(ptr = cb_alloc_bytes(size * elem_size)))
+        return NULL;
+    ptr->kind = CB_TYPED;
+    ptr->bytes = (unsigned char *)ptr->slots;
+    ptr->elem_size = elem_size;
+    ptr->size = size;
+    ptr->mask = ring_mask(size);
+    ptr->cap = size;
+    return ptr;
+}
+
+// `typed_write` copies the element 'data' points to at the end of a CB_TYPED buffer.
+static int typed_write(cbuff_t *cb, any_t data) {
+    if (cb->len == cb->cap)
+        return 0;
+    memcpy(cb->bytes + (size_t)cb->end * cb->elem_size, data.value.pointer_val, cb->elem_size);
+    cb->end = (int)ring_wrap(cb->end + 1, cb->size, cb->mask);
+    len_add(cb, 1);
+    return 1;
+}
+
+// `typed_read` copies the oldest element of a CB_TYPED buffer where 'data' points to.
+static int typed_read(cbuff_t *cb, any_t *data) {
+    if (cb->len == 0)
+        return 0;
+    memcpy(data->value.pointer_val, cb->bytes + (size_t)cb->start * cb->elem_size, cb->elem_size);
+    cb->start = (int)ring_wrap(cb->start + 1, cb->size, cb->mask);
+    len_add(cb, -1);
+    return 1;
+}
+
+// `cb_init_prio` function initializes a new priority buffer of a given size.
+// Returns a pointer to the created buffer on success, NULL on failure.
+cbuff_t *cb_init_prio(size_t size) {
+    cbuff_t *ptr = cb_alloc(0);
+    if (ptr) {
+        ptr->kind = CB_PRIO;
+        ptr->cap = size;
+        ptr->size = size;
+        if (size <= SIZE_MAX / sizeof(cb_prio_t) && (ptr->heap = lc_alloc(size * sizeof(cb_prio_t))) != NULL)
+            return ptr;
+        cb_free(&ptr);
     }
     return NULL;
 }
 
+// `prio_before` tells whether heap entry a must be read before entry b.
+static int prio_before(const cb_prio_t *a, const cb_prio_t *b) {
+    return a->prio > b->prio || (a->prio == b->prio && a->seq < b->seq);
+}
+
+// `prio_write` adds an entry at the bottom of the heap and sifts it up.
+static int prio_write(cbuff_t *cb, any_t data, uint64_t prio) {
+    cb_prio_t entry = { prio, cb->seq++, data };
+    size_t i, parent;
+
+    if (cb->len == cb->cap)
+        return 0;
+    i = cb->len;
+    len_add(cb, 1);
+    for (; i > 0; i = parent) {
+        parent = (i - 1) / 4;
+        if (!prio_before(&entry, &(cb->heap[parent])))
+            break;
+        cb->heap[i] = cb->heap[parent];
+    }
+    cb->heap[i] = entry;
+    return 1;
+}
+
+// `prio_read` removes the top of the heap and sifts the last entry down in its place.
+static int prio_read(cbuff_t *cb, any_t *data, uint64_t *prio) {
+    cb_prio_t last;
+    size_t i, c, best, end;
+
+    if (cb->len == 0)
+        return 0;
+    *data = cb->heap[0].val;
+    if (prio)
+        *prio = cb->heap[0].prio;
+
+    len_add(cb, -1);
+    last = cb->heap[cb->len];
+    for (i = 0; (c = 4 * i + 1) < cb->len; i = best) {
+        best = c;
+        end = c + 4 < cb->len ? c + 4 : cb->len;
+        for (c++; c < end; c++)
+            if (prio_before(&(cb->heap[c]), &(cb->heap[best])))
+                best = c;
+        if (!prio_before(&(cb->heap[best]), &last))
+            break;
+        cb->heap[i] = cb->heap[best];
+    }
+    cb->heap[i] = last;
+    return 1;
+}
+
+// `cb_init_sync` function initializes the counter of a synchronization primitive.
+// Returns a pointer to the created buffer on success, NULL on failure.
+cbuff_t *cb_init_sync(int kind, size_t count, size_t cap) {
+    cbuff_t *ptr = cb_alloc(0);
+    if (ptr) {
+        ptr->kind = kind;
+        ptr->len = count;
+        ptr->cap = cap;
+    }
+    return ptr;
+}
+
+// `cb_init_sharded` function initializes a buffer of 'nshards' shards holding 'size'
+// values in total (rounded up to a multiple of nshards).
+// Returns a pointer to the created buffer on success, NULL on failure.
+cbuff_t *cb_init_sharded(size_t size, size_t nshards) {
+    cbuff_t *ptr;
+    size_t per_shard = (size + nshards - 1) / nshards;
+    size_t i;
+
+    if (nshards == 0 || per_shard == 0 || nshards > SIZE_MAX / sizeof(cb_shard_t) ||
+        per_shard > SIZE_MAX / sizeof(any_t) || !(ptr = cb_alloc(0)))
+        return NULL;
+    ptr->kind = CB_SHARDED;
+    if (!(ptr->shards = lc_calloc(nshards * sizeof(cb_shard_t)))) {
+        cb_free(&ptr);
+        return NULL;
+    }
+    ptr->nshards = nshards;
+    for (i = 0; i < nshards; i++) {
+        pthread_mutex_init(&(ptr->shards[i].mutex), NULL);
+        ptr->shards[i].size = per_shard;
+        ptr->shards[i].mask = ring_mask(per_shard);
+    }
+    for (i = 0; i < nshards; i++) {
+        if (!(ptr->shards[i].buff = lc_alloc(per_shard * sizeof(any_t)))) {
+            cb_free(&ptr);
+            return NULL;
+        }
+    }
+    ptr->cap = per_shard * nshards;
+    ptr->size = ptr->cap;
+    return ptr;
+}
+
+// `shard_home` returns the shard of the calling thread: the one of the core it runs on,
+// or, where that is unknown, one assigned to the thread round-robin.
+static size_t shard_home(cbuff_t *cb) {
+    static atomic_uint next_home;
+    static __thread int home = -1;
+    int cpu = sched_getcpu();
+
+    if (cpu >= 0)
+        return (size_t)cpu % cb->nshards;
+    if (home < 0)
+        home = (int)(atomic_fetch_add(&next_home, 1) & INT32_MAX);
+    return (size_t)home % cb->nshards;
+}
+
+// `sharded_write` pushes a value in the home shard of the caller or, if it is full, in
+// the next shard with room. Returns 1 on success, 0 if every shard is full.
+static int sharded_write(cbuff_t *cb, any_t data) {
+    size_t home = shard_home(cb);
+    cb_shard_t *shard;
+    size_t i;
+
+    for (i = 0; i < cb->nshards; i++) {
+        shard = &(cb->shards[(home + i) % cb->nshards]);
+        pthread_mutex_lock(&(shard->mutex));
+        if (shard->len < shard->size) {
+            shard->buff[ring_wrap(shard->start + shard->len, shard->size, shard->mask)] = data;
+            __atomic_store_n(&(shard->len), shard->len + 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&(shard->mutex));
+            return 1;
+        }
+        pthread_mutex_unlock(&(shard->mutex));
+    }
+    return 0;
+}
+
+// `sharded_read` pops the oldest value of the home shard of the caller or, if it is
+// empty, steals the oldest value of the next shard that has one.
+// Returns 1 on success, 0 if every shard is empty.
+static int sharded_read(cbuff_t *cb, any_t *data) {
+    size_t home = shard_home(cb);
+    cb_shard_t *shard;
+    size_t i;
+
+    for (i = 0; i < cb->nshards; i++) {
+        shard = &(cb->shards[(home + i) % cb->nshards]);
+        // Skip empty shards without taking their lock
+        if (__atomic_load_n(&(shard->len), __ATOMIC_RELAXED) == 0)
+            continue;
+        pthread_mutex_lock(&(shard->mutex));
+        if (shard->len > 0) {
+            *data = shard->buff[shard->start];
+            shard->start = ring_wrap(shard->start + 1, shard->size, shard->mask);
+            __atomic_store_n(&(shard->len), shard->len - 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&(shard->mutex));
+            return 1;
+        }
+        pthread_mutex_unlock(&(shard->mutex));
+    }
+    return 0;
+}
+
+// `sync_token` is the value received from a synchronization primitive.
+static void sync_token(any_t *data) {
+    if (data) {
+        data->type = VAR_INT32;
+        data->value.int32_val = 0;
+    }
+}
+
+// `counter_add` atomically adds delta to the counter of a CB_COUNTER or CB_WAITGROUP
+// buffer, keeping it within [0, cap]. Returns 1 on success, 0 if out of range.
+int counter_add(cbuff_t *cb, long delta) {
+    size_t n = __atomic_load_n(&(cb->len), __ATOMIC_RELAXED);
+
+    do {
+        if ((delta < 0 && n < (size_t)-delta) || (delta > 0 && cb->cap - n < (size_t)delta))
+            return 0;
+    } while (!__atomic_compare_exchange_n(&(cb->len), &n, n + delta, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return 1;
+}
+
+// `counter_take` takes a unit of a CB_COUNTER buffer. Returns 1 on success, 0 if it is 0.
+static int counter_take(cbuff_t *cb, any_t *data) {
+    if (!counter_add(cb, -1))
+        return 0;
+    sync_token(data);
+    return 1;
+}
+
+// `waitgroup_done` succeeds, without consuming anything, once a CB_WAITGROUP counter is 0.
+static int waitgroup_done(cbuff_t *cb, any_t *data) {
+    if (__atomic_load_n(&(cb->len), __ATOMIC_SEQ_CST) != 0)
+        return 0;
+    sync_token(data);
+    return 1;
+}
+
+// `barrier_passed` succeeds once the generation of a CB_BARRIER buffer ('seq') differs
+// from the generation in *key, the one the caller arrived in, and stores the new one.
+static int barrier_passed(cbuff_t *cb, any_t *data, uint64_t *key) {
+    if (!key || cb->seq == *key)
+        return 0;
+    *key = cb->seq;
+    sync_token(data);
+    return 1;
+}
+
+// `cb_lockfree` tells whether the buffer also changes without the channel lock (the
+// synchronization kinds and CB_SHARDED), so that its length transitions are not seen.
+int cb_lockfree(cbuff_t *cb) {
+    switch (cb->kind) {
+    case CB_COUNTER:
+    case CB_WAITGROUP:
+    case CB_BARRIER:
+    case CB_SHARDED:
+        return 1;
+    }
+    return 0;
+}
+
+// `cb_len` returns the number of values in the buffer, without the channel lock. That of
+// a CB_SHARDED buffer is the sum of the lengths of its shards, read one after the other.
+size_t cb_len(cbuff_t *cb) {
+    size_t len = 0;
+    size_t i;
+
+    if (cb->kind != CB_SHARDED)
+        return __atomic_load_n(&(cb->len), __ATOMIC_RELAXED);
+    for (i = 0; i < cb->nshards; i++)
+        len += __atomic_load_n(&(cb->shards[i].len), __ATOMIC_RELAXED);
+    return len;
+}
+
+// `sharded_can` tells whether a shard of a CB_SHARDED buffer has a value (for a read) or
+// room for one (for a write).
+static int sharded_can(cbuff_t *cb, int write) {
+    size_t len;
+    size_t i;
+
+    for (i = 0; i < cb->nshards; i++) {
+        len = __atomic_load_n(&(cb->shards[i].len), __ATOMIC_SEQ_CST);
+        if (write ? len < cb->shards[i].size : len > 0)
+            return 1;
+    }
+    return 0;
+}
+
+// `cb_can_read` and `cb_can_write` tell whether a read or a write would succeed now.
+int cb_can_read(cbuff_t *cb) {
+    switch (cb->kind) {
+    case CB_WAITGROUP:
+        return __atomic_load_n(&(cb->len), __ATOMIC_SEQ_CST) == 0;
+    case CB_BARRIER:
+        return 0;
+    case CB_SHARDED:
+        return sharded_can(cb, 0);
+    }
+    return __atomic_load_n(&(cb->len), __ATOMIC_SEQ_CST) > 0;
+}
+
+int cb_can_write(cbuff_t *cb) {
+    switch (cb->kind) {
+    case CB_WAITGROUP:
+    case CB_BARRIER:
+        return 0;
+    case CB_SHARDED:
+        return sharded_can(cb, 1);
+    }
+    return __atomic_load_n(&(cb->len), __ATOMIC_SEQ_CST) < __atomic_load_n(&(cb->cap), __ATOMIC_RELAXED) ||
+           cb->policy != CB_BLOCK;
+}
+
+// `cb_resize` function moves the values of a CB_RING buffer without spill segment, in
+// order, to a new array of the given size. The size may not be lower than the length.
+// Returns 1 on success, 0 if the buffer cannot be resized to that size.
+int cb_resize(cbuff_t *cb, size_t size) {
+    any_t *buff;
+    size_t i;
+
+    if (!cb || cb->kind != CB_RING || cb->spill || size == 0 || size < cb->len)
+        return 0;
+    if (size > SIZE_MAX / sizeof(any_t) || !(buff = lc_alloc(size * sizeof(any_t))))
+        return 0;
+    for (i = 0; i < cb->len; i++)
+        buff[i] = cb->buff[ring_wrap(cb->start + i, cb->size, cb->mask)];
+
+    // The initial slots belong to the allocation of the header
+    if (cb->buff != cb->slots)
+        lc_free(cb->buff, cb->size * sizeof(any_t));
+    cb->buff = buff;
+    cb->start = 0;
+    cb->end = (int)(cb->len == size ? 0 : cb->len);
+    cb->size = size;
+    cb->mask = ring_mask(size);
+    __atomic_store_n(&(cb->cap), size, __ATOMIC_RELAXED);
+    return 1;
+}
+
 // `cb_deinit` function deallocates the circular buffer pointed by its argument.
 // After this function, the pointer is set to NULL.
 void cb_free(cbuff_t **cb) {
     if (cb && *cb) {
-        if ((*cb)->buff) {
-            free((*cb)->buff);
-            (*cb)->buff = NULL;
+        if ((*cb)->buff && (*cb)->buff != (*cb)->slots)
+            lc_free((*cb)->buff, (*cb)->size * sizeof(any_t));
+        (*cb)->buff = NULL;
+        spill_close(&((*cb)->spill));
+        chunk_free_list((*cb)->head);
+        chunk_free_list((*cb)->free);
+        lc_free((*cb)->keys, (*cb)->size * sizeof(uint64_t));
+        if ((*cb)->index)
+            lc_free((*cb)->index, ((*cb)->imask + 1) * sizeof(uint32_t));
+        lc_free((*cb)->heap, (*cb)->size * sizeof(cb_prio_t));
+        for (size_t i = 0; i < (*cb)->nshards; i++) {
+            pthread_mutex_destroy(&((*cb)->shards[i].mutex));
+            lc_free((*cb)->shards[i].buff, (*cb)->shards[i].size * sizeof(any_t));
         }
-        free(*cb);
-        cb = NULL;
+        lc_free((*cb)->shards, (*cb)->nshards * sizeof(cb_shard_t));
+        if (!(*cb)->embedded)
+            lc_free(*cb, (*cb)->alloc_bytes);
+        *cb = NULL;
     }
 }
 
 // `cb_write` function writes data to the circular buffer.
 // Returns 1 on success, 0 if the buffer is full or cb in NULL.
 int cb_write(cbuff_t *cb, any_t data) {
+    return cb_write_key(cb, data, 0);
+}
+
+// `cb_write_key` function writes data with a key to the buffer. A CB_KEYED buffer
+// replaces the pending value with the same key, if any, and counts it in 'dropped';
+// a CB_PRIO buffer uses the key as priority; other kinds ignore it.
+// Returns 1 on success, 0 if the buffer is full.
+int cb_write_key(cbuff_t *cb, any_t data, uint64_t key) {
     if (!cb)
         return 0;
+    switch (cb->kind) {
+    case CB_CHUNKED:
+        return chunked_write(cb, data);
+    case CB_KEYED:
+        return keyed_write(cb, data, key);
+    case CB_PRIO:
+        return prio_write(cb, data, key);
+    case CB_COUNTER:
+        return counter_add(cb, 1);
+    case CB_SHARDED:
+        return sharded_write(cb, data);
+    case CB_TYPED:
+        return typed_write(cb, data);
+    case CB_WAITGROUP:
+    case CB_BARRIER:
+        return 0;
+    }
     if (cb->len == cb->cap) {
-        return 0;  // El buffer está lleno, no se puede escribir
+        if (cb->policy == CB_BLOCK || cb->spill)
+            return 0;  // El buffer está lleno, no se puede escribir
+        cb->dropped++;
+        if (cb->policy == CB_DROP_NEWEST)
+            return 1;
+        // CB_DROP_OLDEST: the new value takes the slot of the oldest one
+        cb->buff[cb->end] = data;
+        cb->end = (int)ring_wrap(cb->end + 1, cb->size, cb->mask);
+        cb->start = cb->end;
+        return 1;
+    }
+
+    // Once values spill, the following ones must spill too to keep FIFO order
+    if (cb->spill && (cb->spill->len > 0 || cb->len == cb->size)) {
+        spill_write(cb->spill, data);
+        len_add(cb, 1);
+        return 1;
     }
 
     cb->buff[cb->end] = data;
-    cb->end = (cb->end + 1) % cb->cap;
-    cb->len++;
+    cb->end = (int)ring_wrap(cb->end + 1, cb->size, cb->mask);
+    len_add(cb, 1);
 
     return 1;
 }
@@ -49,15 +689,47 @@ int cb_write(cbuff_t *cb, any_t data) {
 // `cb_read` function reads data from the circular buffer.
 // Returns 1 on success, 0 if the buffer is empty or cb is NULL
 int cb_read(cbuff_t *cb, any_t *data) {
+    return cb_read_key(cb, data, NULL);
+}
+
+// `cb_read_key` function reads data and, if 'key' is not NULL, its key from the
+// buffer (0 for buffers without keys). Returns 1 on success, 0 if it is empty.
+int cb_read_key(cbuff_t *cb, any_t *data, uint64_t *key) {
     if (!cb)
         return 0;
+    switch (cb->kind) {
+    case CB_KEYED:
+        return keyed_read(cb, data, key);
+    case CB_PRIO:
+        return prio_read(cb, data, key);
+    case CB_BARRIER:
+        return barrier_passed(cb, data, key);
+    }
+    if (key)
+        *key = 0;
+    switch (cb->kind) {
+    case CB_CHUNKED:
+        return chunked_read(cb, data);
+    case CB_COUNTER:
+        return counter_take(cb, data);
+    case CB_SHARDED:
+        return sharded_read(cb, data);
+    case CB_TYPED:
+        return typed_read(cb, data);
+    case CB_WAITGROUP:
+        return waitgroup_done(cb, data);
+    }
     if (cb->len == 0) {
         return 0;  // El buffer está vacío, no se puede leer
     }
 
     *data = cb->buff[cb->start];
-    cb->start = (cb->start + 1) % cb->cap;
-    cb->len--;
+    cb->start = (int)ring_wrap(cb->start + 1, cb->size, cb->mask);
+    len_add(cb, -1);
+
+    // Refill the freed slot with the oldest spilled value
+    if (cb->spill && spill_read(cb->spill, &(cb->buff[cb->end])))
+        cb->end = (int)ring_wrap(cb->end + 1, cb->size, cb->mask);
 
     return 1;
 }
\ No newline at end of file
@@ -2,29 +2,205 @@
 #define _LC_CB_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "libchannel.h"
+#include "spill.h"
 
-// The `cbuff_t` structure defines a circular buffer that can store `rawdata_t` type data.
+// Kinds of buffers: a fixed circular array, a linked list of chunks without a bound, a
+// conflating circular array where a write replaces the pending value with the same key,
+// a heap that reads the value of highest key (priority) first, the counter of a
+// synchronization primitive (semaphore, wait group, barrier) without any data, a set
+// of per-core circular arrays, or a circular array of fixed size elements.
+#define CB_RING     0
+#define CB_CHUNKED  1
+#define CB_KEYED    2
+#define CB_PRIO     3
+#define CB_COUNTER  4
+#define CB_WAITGROUP 5
+#define CB_BARRIER  6
+#define CB_SHARDED  7
+#define CB_TYPED    8
+
+// What a CB_RING buffer does with a write when it is full: refuse it, discard the new
+// value, or overwrite the oldest one. Discarded values are counted in 'dropped'.
+#define CB_BLOCK        0
+#define CB_DROP_NEWEST  1
+#define CB_DROP_OLDEST  2
+
+// Number of values per chunk of a CB_CHUNKED buffer, and number of drained chunks it
+// keeps for reuse. Chunks beyond that are freed, so memory comes back when it drains.
+#define CB_CHUNK_SIZE   64
+#define CB_FREE_CHUNKS  4
+
+// Entry of a CB_PRIO heap. 'seq' orders the values of equal priority by arrival.
+typedef struct {
+    uint64_t prio;
+    uint64_t seq;
+    any_t    val;
+} cb_prio_t;
+
+// Shard of a CB_SHARDED buffer: a circular array with its own lock, on its own cache
+// lines so that the shards of different cores do not share any. 'mask' is as in cbuff_t.
 typedef struct {
+    pthread_mutex_t mutex;
     any_t *buff;
-    int start;
-    int end;
+    size_t start;
     size_t len;
+    size_t size;
+    size_t mask;
+} __attribute__((aligned(64))) cb_shard_t;
+
+typedef struct cb_chunk {
+    struct cb_chunk *next;
+    any_t vals[CB_CHUNK_SIZE];
+} cb_chunk_t;
+
+// The `cbuff_t` structure defines a circular buffer that can store `rawdata_t` type data.
+// 'size' is the number of slots of 'buff', and 'mask' is size - 1 when size is a power of
+// two (0 otherwise), so that indexes wrap with a mask instead of a division. The slots
+// of a CB_RING buffer follow the header in the same allocation ('slots'), unless the
+// buffer was resized. 'embedded' marks a header that lives in the allocation of its
+// channel (see cb_init_at): cb_free then leaves the header itself to the channel.
+// Otherwise 'alloc_bytes' is the size of the allocation of the header (see alloc.h).
+// The fields are grouped by who writes them, each group on its own cache lines: what
+// is set at creation, what a write moves ('end', 'tail'), what a read moves ('start',
+// 'head') and 'len', which both move and which is read without the channel lock.
+// A buffer with a spill segment stores the
+// values that do not fit in 'buff' in the segment, and 'len' and 'cap' count both.
+// A CB_CHUNKED buffer has no 'buff': it reads at 'start' in the 'head' chunk and writes
+// at 'end' in the 'tail' chunk, and its 'cap' is SIZE_MAX.
+// A CB_KEYED buffer stores the key of each slot of 'buff' in 'keys', and finds the slot of
+// a pending key through 'index', an open addressing table of slot + 1 (0 is a free entry).
+// A CB_PRIO buffer has no 'buff': its values are in 'heap', a 4-ary heap of 'len' entries.
+// The synchronization kinds have no storage either. 'len' is their counter, updated with
+// atomic operations so that the fast paths in sync.c can skip the channel lock: the units
+// of a CB_COUNTER (semaphore) or the pending tasks of a CB_WAITGROUP. A CB_BARRIER counts
+// the parties that arrived ('len' of 'cap') and its generation in 'seq'.
+// A CB_SHARDED buffer has no 'buff' either: its values are in 'nshards' shards, each with
+// its own lock, so that it can be used without the channel lock. Its 'len' stays 0: the
+// length of each shard is stored atomically under the lock of the shard, and cb_len and
+// cb_can_* read them, so that no word is written by every send and receive.
+// A CB_TYPED buffer is a ring of 'size' elements of 'elem_size' bytes in 'bytes', in the
+// allocation of the header. Its values are not any_t: the any_t of a write or a read
+// holds a pointer (VAR_POINTER) to the element to copy from or to.
+typedef struct {
+    int kind;
+    int policy;
+    int embedded;
+    size_t alloc_bytes;
+    any_t *buff;
+    size_t size;
+    size_t mask;
     size_t cap;
+    spill_t *spill;
+    uint64_t *keys;
+    uint32_t *index;
+    size_t imask;
+    cb_prio_t *heap;
+    cb_shard_t *shards;
+    size_t nshards;
+    unsigned char *bytes;
+    size_t elem_size;
+
+    int end __attribute__((aligned(64)));
+    cb_chunk_t *tail;
+    uint64_t dropped;
+    uint64_t seq;
+
+    int start __attribute__((aligned(64)));
+    cb_chunk_t *head;
+    cb_chunk_t *free;
+    int nfree;
+
+    size_t len __attribute__((aligned(64)));
+
+    any_t slots[] __attribute__((aligned(64)));
 } cbuff_t;
 
+// `cb_footprint` returns the number of bytes cb_init_at needs for a CB_RING buffer of
+// a given size: the header followed by the slots.
+extern size_t cb_footprint(size_t size);
+
+// `cb_init_at` function initializes a CB_RING buffer of a given size in 'mem', which
+// holds cb_footprint(size) zeroed bytes aligned on a cache line. Used to place the
+// buffer in the same allocation as its channel. Returns 'mem' as a buffer.
+extern cbuff_t *cb_init_at(void *mem, size_t size);
+
 // `cb_init` function initializes a new circular buffer of a given size.
 // Returns a pointer to the created buffer on success, NULL on failure.
 extern cbuff_t *cb_init(size_t size);
 
+// `cb_init_spill` function initializes a circular buffer of a given size that overflows
+// into a spill segment of at most max_bytes, in an unnamed file of the directory dir.
+// Returns a pointer to the created buffer on success, NULL on failure.
+extern cbuff_t *cb_init_spill(size_t size, const char *dir, size_t max_bytes);
+
+// `cb_init_chunked` function initializes a new unbounded buffer made of chunks.
+// Returns a pointer to the created buffer on success, NULL on failure.
+extern cbuff_t *cb_init_chunked(void);
+
+// `cb_init_keyed` function initializes a new conflating buffer of a given size.
+// Returns a pointer to the created buffer on success, NULL on failure.
+extern cbuff_t *cb_init_keyed(size_t size);
+
+// `cb_init_prio` function initializes a new priority buffer of a given size.
+// Returns a pointer to the created buffer on success, NULL on failure.
+extern cbuff_t *cb_init_prio(size_t size);
+
+// `cb_init_sync` function initializes the counter of a synchronization primitive of the
+// given kind, with a counter of 'count' and a capacity of 'cap'.
+// Returns a pointer to the created buffer on success, NULL on failure.
+extern cbuff_t *cb_init_sync(int kind, size_t count, size_t cap);
+
+// `cb_init_sharded` function initializes a buffer of 'nshards' shards holding 'size'
+// values in total (rounded up to a multiple of nshards).
+// Returns a pointer to the created buffer on success, NULL on failure.
+extern cbuff_t *cb_init_sharded(size_t size, size_t nshards);
+
+// `cb_init_typed` function initializes a buffer of 'size' elements of 'elem_size' bytes.
+// Returns a pointer to the created buffer on success, NULL on failure.
+extern cbuff_t *cb_init_typed(size_t size, size_t elem_size);
+
+// `counter_add` atomically adds delta to the counter of a CB_COUNTER or CB_WAITGROUP
+// buffer, keeping it within [0, cap]. Returns 1 on success, 0 if out of range.
+extern int counter_add(cbuff_t *cb, long delta);
+
+// `cb_lockfree` tells whether the buffer also changes without the channel lock (the
+// synchronization kinds and CB_SHARDED), so that its length transitions are not seen.
+extern int cb_lockfree(cbuff_t *cb);
+
+// `cb_len` returns the number of values in the buffer, without the channel lock.
+extern size_t cb_len(cbuff_t *cb);
+
+// `cb_can_read` and `cb_can_write` tell whether a read or a write would succeed now.
+extern int cb_can_read(cbuff_t *cb);
+extern int cb_can_write(cbuff_t *cb);
+
+// `cb_resize` function moves the values of a CB_RING buffer without spill segment, in
+// order, to a new array of the given size. The size may not be lower than the length.
+// Returns 1 on success, 0 if the buffer cannot be resized to that size.
+extern int cb_resize(cbuff_t *cb, size_t size);
+
 // `cb_deinit` function deallocates the circular buffer pointed by its argument.
 // After this function, the pointer is set to NULL.
 extern void cb_free(cbuff_t **cb);
 
 // `cb_write` function writes data to the circular buffer.
 // Returns 0 on success, -1 if the buffer is full.
+// A full buffer with a drop policy discards a value and counts it as written.
 extern int cb_write(cbuff_t *cb, any_t data);
 
+// `cb_write_key` function writes data with a key to the buffer. A CB_KEYED buffer
+// replaces the pending value with the same key, if any, and counts it in 'dropped';
+// a CB_PRIO buffer uses the key as priority; other kinds ignore it.
+// Returns 1 on success, 0 if the buffer is full.
+extern int cb_write_key(cbuff_t *cb, any_t data, uint64_t key);
+
+// `cb_read_key` function reads data and, if 'key' is not NULL, its key from the
+// buffer (0 for buffers without keys). Returns 1 on success, 0 if it is empty.
+extern int cb_read_key(cbuff_t *cb, any_t *data, uint64_t *key);
+
 // `cb_read` function reads data from the circular buffer.
 // Returns 0 on success, -1 if the buffer is empty.
 extern int cb_read(cbuff_t *cb, any_t *data);
@@ -1,33 +1,103 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "chan.h"
 #include "cb.h"
+#include "atomic.h"
+#include "cvpool.h"
+#include "selgroup.h"
+#include "alloc.h"
+
+/*
+ * Function: chan_alloc
+ * ---------------------
+ * Allocate a zeroed channel followed by 'extra' bytes, aligned on a cache line as
+ * the field groups of 'chan_t' require, and initialize its fields. The buffer is
+ * left to the caller. Returns NULL if memory allocation fails.
+ */
+static chan_t *chan_alloc(size_t extra, int lock_kind) {
+    chan_t *chan;
+
+    if (extra > SIZE_MAX - sizeof(chan_t) || !(chan = lc_calloc(sizeof(chan_t) + extra)))
+        return NULL;
+    chan->alloc_bytes = sizeof(chan_t) + extra;
+    chan->cb = NULL;
+    chan->send_shift = 0;
+    chan->recv_shift = 0;
+    chan->sendq.len = 0;
+    chan->sendq.head = NULL;
+    chan->sendq.tail = NULL;
+    chan->recvq.len = 0;
+    chan->recvq.head = NULL;
+    chan->recvq.tail = NULL;
+    chan->recv_fd = -1;
+    chan->send_fd = -1;
+    chan->combining = 0;
+    atomic_init(&(chan->fc_pending), NULL);
+    chan->watches = NULL;
+    chlock_init(&(chan->lock), lock_kind);
+    return chan;
+}
 
 /*
  * Function: new_chan
  * ---------------------
- * Initialize a new channel of given length.
+ * Initialize a new channel of given length. The channel, its buffer header and the
+ * slots of the buffer are one allocation, so that an operation does not chase
+ * pointers across unrelated cache lines.
  *
  * Parameters:
  * len: the length for the channel's internal buffer.
+ * lock_kind: the kind of the channel lock, one of the CHLOCK_* constants.
  *
  * Returns: a pointer to the newly allocated channel. If memory allocation 
  * fails, returns NULL.
  *
  */
-chan_t *new_chan(size_t len) {
-    chan_t *chan = calloc(1, sizeof(chan_t));
-    if (chan) {
-        chan->cb = cb_init(len);
-        chan->send_shift = NULL;
-        chan->recv_shift = NULL;
-        chan->sendq.len = 0;
-        chan->sendq.head = NULL;
-        chan->sendq.tail = NULL;
-        chan->recvq.len = 0;
-        chan->recvq.head = NULL;
-        chan->recvq.tail = NULL;
-        pthread_mutex_init(&(chan->mutex), NULL);
-    }
+chan_t *new_chan(size_t len, int lock_kind) {
+    size_t bytes = cb_footprint(len);
+    chan_t *chan = bytes ? chan_alloc(bytes, lock_kind) : NULL;
+    if (chan)
+        chan->cb = cb_init_at(chan + 1, len);
+    return chan;
+}
+
+/*
+ * Function: new_chan_footprint
+ * -----------------------------
+ * Return the size of the allocation of a channel made by new_chan.
+ *
+ * Parameters:
+ * len: the length for the channel's internal buffer.
+ *
+ * Returns: the size in bytes, or 0 if it overflows.
+ *
+ */
+size_t new_chan_footprint(size_t len) {
+    size_t bytes = cb_footprint(len);
+    return (bytes && bytes <= SIZE_MAX - sizeof(chan_t)) ? sizeof(chan_t) + bytes : 0;
+}
+
+/*
+ * Function: new_chan_cb
+ * ---------------------
+ * Initialize a new channel around an already created buffer.
+ *
+ * Parameters:
+ * cb: the channel's internal buffer. The channel takes ownership of it.
+ * lock_kind: the kind of the channel lock, one of the CHLOCK_* constants.
+ *
+ * Returns: a pointer to the newly allocated channel. If memory allocation 
+ * fails, frees the buffer and returns NULL.
+ *
+ */
+chan_t *new_chan_cb(cbuff_t *cb, int lock_kind) {
+    chan_t *chan = chan_alloc(0, lock_kind);
+    if (!chan)
+        cb_free(&cb);
+    else
+        chan->cb = cb;
     return chan;
 }
 
@@ -46,8 +116,34 @@ chan_t *new_chan(size_t len) {
 void del_chan(chan_t *chan) {
     if (chan) {
         cb_free(&(chan->cb));
-        pthread_mutex_destroy(&(chan->mutex));
-        free(chan);
+        if (chan->recv_fd >= 0)
+            close(chan->recv_fd);
+        if (chan->send_fd >= 0)
+            close(chan->send_fd);
+        chlock_destroy(&(chan->lock));
+        lc_free(chan, chan->alloc_bytes);
+    }
+}
+
+/*
+ * Function: purge_stale
+ * ---------------------
+ * Remove from a wait queue the nodes of waits that already ended elsewhere: claimed
+ * by another channel, cancelled by a context or withdrawn by a timeout. Wakers skip
+ * such nodes anyway; purging them lets a channel nobody waits on be closed.
+ */
+static void purge_stale(waitq_t *waitq) {
+    waitq_node_t *node;
+    waitq_node_t *next;
+    condvar_t *cv;
+
+    for (node = waitq->head; node; node = next) {
+        next = node->next;
+        if (atomic_load(&(node->ptrcv->cd)) == CV_NULL_CHANNEL_DESCRIPTOR)
+            continue;
+        cv = waitq_remove(waitq, node);
+        if (ATOMIC_DEC(&(cv->ref)) == 0)
+            release_condvar(&cv);
     }
 }
 
@@ -57,7 +153,10 @@ void del_chan(chan_t *chan) {
  * Check if a channel can be closed. 
  *
  * A channel is closeable if there are no shifts waiting to send or receive 
- * from it and if its send and receive queues are empty.
+ * from it, no send is published for a combiner, and if its send and receive
+ * queues are empty. Queue nodes of waits that ended elsewhere (cancelled,
+ * timed out or served by another channel) are purged first. Must be called
+ * with the channel locked.
  *
  * Parameters:
  * chan: a pointer to the channel to be checked.
@@ -66,7 +165,136 @@ void del_chan(chan_t *chan) {
  *
  */
 int is_closeable(chan_t *chan) {
-    return (chan->recv_shift == NULL && chan->recvq.len == 0 && chan->send_shift == NULL && chan->sendq.len == 0);
+    purge_stale(&(chan->recvq));
+    purge_stale(&(chan->sendq));
+    return (chan->recv_shift == 0 && chan->recvq.len == 0 && chan->send_shift == 0 && chan->sendq.len == 0 &&
+            atomic_load(&(chan->fc_pending)) == NULL);
+}
+
+/*
+ * Function: chan_ready_fd
+ * ------------------------
+ * Return the readiness eventfd of a channel for the given operation type,
+ * creating it on first use. The new descriptor starts readable if the
+ * operation could complete right now. Must be called with the channel locked.
+ *
+ * Parameters:
+ * chan: a pointer to the channel.
+ * op_type: OP_RECV for the "has data" descriptor, OP_SEND for the "has space" one.
+ *
+ * Returns: the eventfd, or -1 if it could not be created.
+ *
+ */
+int chan_ready_fd(chan_t *chan, int op_type) {
+    int *fd;
+    int ready;
+
+    // The counters of synchronization primitives and the shards of sharded channels
+    // change without the channel lock
+    if (!chan->cb || cb_lockfree(chan->cb))
+        return -1;
+
+    if (op_type == OP_RECV) {
+        fd = &(chan->recv_fd);
+        ready = cb_can_read(chan->cb);
+    } else {
+        fd = &(chan->send_fd);
+        ready = cb_can_write(chan->cb);
+    }
+    if (*fd < 0)
+        *fd = eventfd(ready ? 1 : 0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return *fd;
 }
 
+/*
+ * Function: chan_notify
+ * ----------------------
+ * Write or drain the readiness eventfds of a channel according to how its
+ * length and capacity changed, and queue its select group watches for the
+ * operations that became possible. Must be called with the channel locked.
+ */
+static void chan_notify(chan_t *chan, size_t prev_len, size_t prev_cap) {
+    eventfd_t drain;
+    size_t len = __atomic_load_n(&(chan->cb->len), __ATOMIC_RELAXED);
+    size_t cap = __atomic_load_n(&(chan->cb->cap), __ATOMIC_RELAXED);
 
+    if (chan->watches)
+        selgroup_notify(chan, prev_len == 0 && len > 0, prev_len == prev_cap && len < cap);
+
+    if (chan->recv_fd >= 0) {
+        if (prev_len == 0 && len > 0)
+            eventfd_write(chan->recv_fd, 1);
+        else if (prev_len > 0 && len == 0)
+            eventfd_read(chan->recv_fd, &drain);
+    }
+    // Sends on a channel with a drop policy always complete
+    if (chan->send_fd >= 0 && chan->cb->policy == CB_BLOCK) {
+        if (prev_len == prev_cap && len < cap)
+            eventfd_write(chan->send_fd, 1);
+        else if (prev_len < prev_cap && len == cap)
+            eventfd_read(chan->send_fd, &drain);
+    }
+}
+
+/*
+ * Function: chan_notify_ready
+ * ----------------------------
+ * Update the readiness eventfds of a channel after its buffer changed length.
+ * A descriptor is written when its condition becomes true and drained when it
+ * becomes false, so it stays readable exactly while the operation can complete.
+ * Must be called with the channel locked.
+ *
+ * Parameters:
+ * chan: a pointer to the channel.
+ * prev_len: the buffer length before the operation.
+ *
+ * Returns: nothing.
+ *
+ */
+void chan_notify_ready(chan_t *chan, size_t prev_len) {
+    chan_notify(chan, prev_len, __atomic_load_n(&(chan->cb->cap), __ATOMIC_RELAXED));
+}
+
+/*
+ * Function: chan_notify_resized
+ * ------------------------------
+ * Update the readiness eventfds of a channel after its buffer changed capacity.
+ * Must be called with the channel locked.
+ *
+ * Parameters:
+ * chan: a pointer to the channel.
+ * prev_cap: the buffer capacity before the resize.
+ *
+ * Returns: nothing.
+ *
+ */
+void chan_notify_resized(chan_t *chan, size_t prev_cap) {
+    chan_notify(chan, __atomic_load_n(&(chan->cb->len), __ATOMIC_RELAXED), prev_cap);
+}
+
+/*
+ * Function: chan_init_handle
+ * ---------------------------
+ * Fill the public handle of a channel once its descriptor is known.
+ *
+ * Parameters:
+ * chan: a pointer to the channel.
+ * handle: the handle to fill.
+ * cd: its descriptor.
+ *
+ * Returns: nothing.
+ *
+ */
+void chan_init_handle(chan_t *chan, chan_handle_t *handle, int cd) {
+    int kind = chan->cb->kind;
+    // Neither the sync kinds nor a sharded buffer, whose length is spread over its
+    // shards, have a single word the inline check could read
+    int slow = (kind == CB_WAITGROUP || kind == CB_BARRIER || kind == CB_SHARDED);
+
+    handle->cd = cd;
+    handle->closed = 0;
+    handle->fast_send = !slow && kind != CB_KEYED && chan->cb->policy == CB_BLOCK;
+    handle->fast_recv = !slow;
+    handle->len = &(chan->cb->len);
+    handle->cap = &(chan->cb->cap);
+}
@@ -6,7 +6,7 @@
  * The 'chan_t' structure is the main structure that represents a channel. It includes 
  * pointers to 'cbuff_t' (circular buffer), 'recv_shift' and 'send_shift' for the receiving 
  * and sending threads respectively. It also contains two wait queues 'recvq' and 'sendq' 
- * for the receiving and sending operations respectively. Furthermore, it includes a mutex 
+ * for the receiving and sending operations respectively. Furthermore, it includes a lock 
  * to ensure safe concurrent access.
  *
  * The file also includes the necessary headers for various types, circular buffer, 
@@ -16,11 +16,24 @@
  * chan_t: The structure representing a channel.
  *
  *      cbuff_t *cb: A pointer to the circular buffer of the channel.
- *      pthread_mutex_t  mutex: A mutex for the channel to ensure safe concurrent access.
- *      pthread_t *recv_shift: A pointer to the receiving thread.
- *      pthread_t *send_shift: A pointer to the sending thread.
+ *      chlock_t lock: The lock of the channel, of the kind chosen at creation (see chlock.h).
+ *      owner_t recv_shift: The receiver the next receive is reserved for, or 0.
+ *      owner_t send_shift: The sender the next send is reserved for, or 0.
  *      waitq_t recvq: A wait queue for the receiving operations.
  *      waitq_t sendq: A wait queue for the sending operations.
+ *      int recv_fd: An eventfd readable while the channel holds data (-1 until requested).
+ *      int send_fd: An eventfd readable while the channel has free space (-1 until requested).
+ *      int combining: Whether sends go through the flat-combining path (CHAN_COMBINING).
+ *      fc_rec_t *fc_pending: The sends published for the next combiner, newest first.
+ *      struct sg_watch *watches: The select group registrations on the channel.
+ *      size_t alloc_bytes: The size of the allocation of the channel (see alloc.h).
+ *
+ * The fields are grouped on separate cache lines: those set at creation or rarely
+ * changed, those every operation changes under the lock, and 'fc_pending', on which
+ * combining senders contend without the lock. The shifts are only written with the
+ * lock held, but with atomic stores, as select_probe and select_fast_op read them
+ * without it. A ring channel is a single allocation:
+ * the channel, then its buffer header, then the slots (see new_chan).
  *
  * Note:
  * chan.h should only be included once, hence the use of '_LC_CHAN_' definition to 
@@ -31,37 +44,93 @@
 
 
 #define CV_NULL_CHANNEL_DESCRIPTOR -1
+#define CV_CANCELLED_CHANNEL_DESCRIPTOR -2
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "libchannel.h"
 #include "cb.h"
 #include "waitq.h"
+#include "chlock.h"
+
+/*
+ * `fc_rec_t` is the publication record of a send on a flat-combining channel. It lives
+ * on the stack of the sender, which spins until 'status' leaves FC_PENDING: the thread
+ * holding the channel lock applies every published send in one pass.
+ */
+#define FC_PENDING 0
+#define FC_DONE    1
+#define FC_FULL    2
+
+typedef struct fc_rec {
+    any_t          val;
+    owner_t        owner;
+    atomic_int     status;
+    struct fc_rec *next;
+} fc_rec_t;
 
 typedef struct {
-    cbuff_t *cb;    
-    pthread_mutex_t mutex;
+    cbuff_t *cb;
+    int recv_fd;
+    int send_fd;
+    int combining;
+    struct sg_watch *watches;
+    size_t alloc_bytes;
 
-    pthread_t *recv_shift;
-    pthread_t *send_shift;
-    
+    chlock_t lock __attribute__((aligned(64)));
+    owner_t recv_shift;
+    owner_t send_shift;
     waitq_t recvq;
     waitq_t sendq;
+
+    _Atomic(fc_rec_t *) fc_pending __attribute__((aligned(64)));
 } chan_t;
 
 /*
  * Function: new_chan
  * ---------------------
- * Initialize a new channel of given length.
+ * Initialize a new channel of given length, with a CB_RING buffer placed in the
+ * same allocation as the channel.
  *
  * Parameters:
  * len: the length for the channel's internal buffer.
+ * lock_kind: the kind of the channel lock, one of the CHLOCK_* constants.
  *
  * Returns: a pointer to the newly allocated channel. If memory allocation 
  * fails, returns NULL.
  *
  */
-extern chan_t *new_chan(size_t);
+extern chan_t *new_chan(size_t len, int lock_kind);
+
+/*
+ * Function: new_chan_footprint
+ * -----------------------------
+ * Return the size of the allocation of a channel made by new_chan, so that memory
+ * for such channels can be prepared ahead of use (see lc_prewarm).
+ *
+ * Parameters:
+ * len: the length for the channel's internal buffer.
+ *
+ * Returns: the size in bytes, or 0 if it overflows.
+ *
+ */
+extern size_t new_chan_footprint(size_t len);
+
+/*
+ * Function: new_chan_cb
+ * ---------------------
+ * Initialize a new channel around an already created buffer.
+ *
+ * Parameters:
+ * cb: the channel's internal buffer. The channel takes ownership of it.
+ * lock_kind: the kind of the channel lock, one of the CHLOCK_* constants.
+ *
+ * Returns: a pointer to the newly allocated channel. If memory allocation 
+ * fails, frees the buffer and returns NULL.
+ *
+ */
+extern chan_t *new_chan_cb(cbuff_t *cb, int lock_kind);
 
 /*
  * Function: del_chan
@@ -82,7 +151,10 @@ extern void del_chan(chan_t *chan);
  * Check if a channel can be closed. 
  *
  * A channel is closeable if there are no shifts waiting to send or receive 
- * from it and if its send and receive queues are empty.
+ * from it, no send is published for a combiner, and if its send and receive
+ * queues are empty. Queue nodes of waits
+ * that ended elsewhere (cancelled, timed out or served by another channel)
+ * are purged first. Must be called with the channel locked.
  *
  * Parameters:
  * chan: a pointer to the channel to be checked.
@@ -92,5 +164,74 @@ extern void del_chan(chan_t *chan);
  */
 extern int is_closeable(chan_t *chan);
 
+/*
+ * Function: chan_ready_fd
+ * ------------------------
+ * Return the readiness eventfd of a channel for the given operation type,
+ * creating it on first use. The new descriptor starts readable if the
+ * operation could complete right now. Must be called with the channel locked.
+ *
+ * Parameters:
+ * chan: a pointer to the channel.
+ * op_type: OP_RECV for the "has data" descriptor, OP_SEND for the "has space" one.
+ *
+ * Returns: the eventfd, or -1 if it could not be created.
+ *
+ */
+extern int chan_ready_fd(chan_t *chan, int op_type);
+
+/*
+ * Function: chan_notify_ready
+ * ----------------------------
+ * Update the readiness eventfds of a channel after its buffer changed length.
+ * The descriptors are only touched on empty<->non-empty and full<->non-full
+ * transitions, so a busy channel does not pay an eventfd write per message.
+ * Must be called with the channel locked.
+ *
+ * Parameters:
+ * chan: a pointer to the channel.
+ * prev_len: the buffer length before the operation.
+ *
+ * Returns: nothing.
+ *
+ */
+extern void chan_notify_ready(chan_t *chan, size_t prev_len);
+
+/*
+ * Function: chan_notify_resized
+ * ------------------------------
+ * Update the readiness eventfds of a channel after its buffer changed capacity.
+ * Must be called with the channel locked.
+ *
+ * Parameters:
+ * chan: a pointer to the channel.
+ * prev_cap: the buffer capacity before the resize.
+ *
+ * Returns: nothing.
+ *
+ */
+extern void chan_notify_resized(chan_t *chan, size_t prev_cap);
+
+/*
+ * Function: chan_init_handle
+ * ---------------------------
+ * Fill the public handle of a channel (see chan_handle in libchannel.h) once its
+ * descriptor is known. The handle is not part of the channel: it lives in a table
+ * of chpool.c that is never freed, so that it can still report the channel closed.
+ * The inline checks are only enabled for the buffers where a send needs free space
+ * and a receive needs a value, and whose length is a single word: not for drop
+ * policies and keyed buffers (a send always completes, or may replace a value),
+ * nor for wait groups and barriers (a receive waits for the counter to reach its
+ * goal), nor for sharded buffers (their length is spread over the shards).
+ *
+ * Parameters:
+ * chan: a pointer to the channel.
+ * handle: the handle to fill.
+ * cd: its descriptor.
+ *
+ * Returns: nothing.
+ *
+ */
+extern void chan_init_handle(chan_t *chan, chan_handle_t *handle, int cd);
 
 #endif
\ No newline at end of file
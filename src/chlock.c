@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "chlock.h"
+
+/*
+ * Constant: SPINS_BEFORE_YIELD
+ * ----------------------------
+ * How many times a waiter of a spinning lock polls before giving the CPU away, so
+ * that a holder preempted on the same core gets to release the lock.
+ */
+#define SPINS_BEFORE_YIELD 64
+
+/*
+ * `mcs_cache_t` holds the free MCS nodes of a thread. It is reached through the
+ * thread-local 'mcs_cache', and registered under 'mcs_key' so that the nodes are
+ * freed when the thread exits.
+ */
+typedef struct {
+    mcs_node_t *free;
+} mcs_cache_t;
+
+static __thread mcs_cache_t *mcs_cache = NULL;
+static pthread_key_t  mcs_key;
+static pthread_once_t mcs_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Function: free_mcs_cache
+ * ------------------------
+ * Thread-specific data destructor that frees the MCS nodes of an exiting thread.
+ */
+static void free_mcs_cache(void *value) {
+    mcs_cache_t *cache = value;
+    mcs_node_t *node;
+
+    while ((node = cache->free) != NULL) {
+        cache->free = node->free_next;
+        free(node);
+    }
+    free(cache);
+}
+
+static void make_mcs_key(void) {
+    pthread_key_create(&mcs_key, free_mcs_cache);
+}
+
+/*
+ * Function: spin_wait
+ * -------------------
+ * One round of a spin loop: yields the CPU every SPINS_BEFORE_YIELD rounds.
+ */
+static void spin_wait(int *spins) {
+    if (++(*spins) % SPINS_BEFORE_YIELD == 0)
+        sched_yield();
+}
+
+/*
+ * Function: mcs_node_get
+ * ----------------------
+ * Takes a node from the free list of the calling thread, allocating one if the list
+ * is empty. A lock cannot fail, so an allocation failure is retried.
+ */
+static mcs_node_t *mcs_node_get(void) {
+    mcs_node_t *node;
+    int spins = 0;
+
+    while (!mcs_cache) {
+        pthread_once(&mcs_once, make_mcs_key);
+        if ((mcs_cache = calloc(1, sizeof(mcs_cache_t))) != NULL)
+            pthread_setspecific(mcs_key, mcs_cache);
+        else
+            spin_wait(&spins);
+    }
+    if ((node = mcs_cache->free) != NULL)
+        mcs_cache->free = node->free_next;
+    else
+        while ((node = malloc(sizeof(mcs_node_t))) == NULL)
+            spin_wait(&spins);
+    atomic_store_explicit(&(node->next), NULL, memory_order_relaxed);
+    atomic_store_explicit(&(node->locked), 1, memory_order_relaxed);
+    return node;
+}
+
+/*
+ * Function: mcs_node_put
+ * ----------------------
+ * Gives a node back to the free list of the calling thread.
+ */
+static void mcs_node_put(mcs_node_t *node) {
+    node->free_next = mcs_cache->free;
+    mcs_cache->free = node;
+}
+
+int chlock_init(chlock_t *lock, int kind) {
+    if (kind != CHLOCK_MUTEX && kind != CHLOCK_TICKET && kind != CHLOCK_MCS)
+        return -1;
+    lock->kind = kind;
+    pthread_mutex_init(&(lock->mutex), NULL);
+    atomic_init(&(lock->next), 0);
+    atomic_init(&(lock->serving), 0);
+    atomic_init(&(lock->tail), NULL);
+    lock->holder = NULL;
+    return 0;
+}
+
+void chlock_destroy(chlock_t *lock) {
+    pthread_mutex_destroy(&(lock->mutex));
+}
+
+void chlock_lock(chlock_t *lock) {
+    mcs_node_t *node;
+    mcs_node_t *prev;
+    unsigned int ticket;
+    int spins = 0;
+
+    switch (lock->kind) {
+    case CHLOCK_TICKET:
+        ticket = atomic_fetch_add_explicit(&(lock->next), 1, memory_order_relaxed);
+        while (atomic_load_explicit(&(lock->serving), memory_order_acquire) != ticket)
+            spin_wait(&spins);
+        break;
+    case CHLOCK_MCS:
+        node = mcs_node_get();
+        prev = atomic_exchange_explicit(&(lock->tail), node, memory_order_acq_rel);
+        if (prev) {
+            atomic_store_explicit(&(prev->next), node, memory_order_release);
+            while (atomic_load_explicit(&(node->locked), memory_order_acquire))
+                spin_wait(&spins);
+        }
+        lock->holder = node;
+        break;
+    default:
+        pthread_mutex_lock(&(lock->mutex));
+    }
+}
+
+int chlock_trylock(chlock_t *lock) {
+    mcs_node_t *node;
+    mcs_node_t *expected = NULL;
+    unsigned int serving;
+
+    switch (lock->kind) {
+    case CHLOCK_TICKET:
+        serving = atomic_load_explicit(&(lock->serving), memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&(lock->next), &serving, serving + 1,
+                                                    memory_order_acquire, memory_order_relaxed))
+            return 0;
+        return EBUSY;
+    case CHLOCK_MCS:
+        node = mcs_node_get();
+        if (atomic_compare_exchange_strong_explicit(&(lock->tail), &expected, node,
+                                                    memory_order_acq_rel, memory_order_relaxed)) {
+            lock->holder = node;
+            return 0;
+        }
+        mcs_node_put(node);
+        return EBUSY;
+    default:
+        return pthread_mutex_trylock(&(lock->mutex));
+    }
+}
+
+void chlock_unlock(chlock_t *lock) {
+    mcs_node_t *node;
+    mcs_node_t *next;
+    mcs_node_t *expected;
+    unsigned int serving;
+    int spins = 0;
+
+    switch (lock->kind) {
+    case CHLOCK_TICKET:
+        serving = atomic_load_explicit(&(lock->serving), memory_order_relaxed);
+        atomic_store_explicit(&(lock->serving), serving + 1, memory_order_release);
+        break;
+    case CHLOCK_MCS:
+        node = lock->holder;
+        lock->holder = NULL;
+        if ((next = atomic_load_explicit(&(node->next), memory_order_acquire)) == NULL) {
+            expected = node;
+            if (atomic_compare_exchange_strong_explicit(&(lock->tail), &expected, NULL,
+                                                        memory_order_release, memory_order_relaxed)) {
+                mcs_node_put(node);
+                break;
+            }
+            // A waiter swapped itself in as the tail but did not link to us yet
+            while ((next = atomic_load_explicit(&(node->next), memory_order_acquire)) == NULL)
+                spin_wait(&spins);
+        }
+        atomic_store_explicit(&(next->locked), 0, memory_order_release);
+        mcs_node_put(node);
+        break;
+    default:
+        pthread_mutex_unlock(&(lock->mutex));
+    }
+}
@@ -0,0 +1,102 @@
+/*
+ * File: chlock.h
+ * ----------------------------
+ * This header file includes the lock that protects a channel.
+ *
+ * The kind of lock is chosen when the channel is created and does not change:
+ *
+ *      CHLOCK_MUTEX:  a pthread mutex. Waiters sleep in the kernel; the default.
+ *      CHLOCK_TICKET: a ticket lock. Waiters spin on a shared counter and get the
+ *                     lock in arrival order.
+ *      CHLOCK_MCS:    an MCS queue lock. Waiters spin on a flag of their own queue
+ *                     node, so a release only touches the cache line of the next
+ *                     waiter, and the lock is granted in arrival order.
+ *
+ * The spinning kinds suit channels whose critical sections are a few hundred cycles
+ * and whose contenders run on other cores; they yield the CPU from time to time, so
+ * they stay correct, if slower, when threads outnumber cores. None of them is
+ * reentrant. Holding several channel locks at once is deadlock-free as long as they
+ * are taken in ascending descriptor order, whatever their kinds (see lockall).
+ *
+ * Functions:
+ * chlock_init: Initializes a lock of the given kind.
+ * chlock_destroy: Releases the resources of a lock.
+ * chlock_lock: Acquires a lock.
+ * chlock_trylock: Acquires a lock if it is free.
+ * chlock_unlock: Releases a lock.
+ */
+#ifndef _LC_CHLOCK_H
+#define _LC_CHLOCK_H 1
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define CHLOCK_MUTEX  0
+#define CHLOCK_TICKET 1
+#define CHLOCK_MCS    2
+
+/*
+ * `mcs_node_t` is the queue node of a thread waiting for, or holding, an MCS lock.
+ * Nodes come from a free list of the thread, as a thread holds one per MCS lock it
+ * is taking or holds (lockall takes many).
+ */
+typedef struct mcs_node {
+    _Atomic(struct mcs_node *) next;
+    atomic_int                 locked;
+    struct mcs_node           *free_next;
+} mcs_node_t;
+
+/*
+ * `chlock_t` is the lock of a channel. Only the fields of its kind are used:
+ * 'mutex'; 'next' and 'serving' for the ticket lock; 'tail' and 'holder' (the node of
+ * the thread holding the lock, read only by that thread) for the MCS lock.
+ */
+typedef struct {
+    int                  kind;
+    pthread_mutex_t      mutex;
+    atomic_uint          next;
+    atomic_uint          serving;
+    _Atomic(mcs_node_t *) tail;
+    mcs_node_t          *holder;
+} chlock_t;
+
+/*
+ * Function: chlock_init
+ * ---------------------
+ * Initializes a lock of the given kind.
+ *
+ * Returns: 0 on success, -1 if 'kind' is not a lock kind.
+ */
+extern int chlock_init(chlock_t *lock, int kind);
+
+/*
+ * Function: chlock_destroy
+ * ------------------------
+ * Releases the resources of a lock nobody holds.
+ */
+extern void chlock_destroy(chlock_t *lock);
+
+/*
+ * Function: chlock_lock
+ * ---------------------
+ * Acquires a lock, waiting as long as needed.
+ */
+extern void chlock_lock(chlock_t *lock);
+
+/*
+ * Function: chlock_trylock
+ * ------------------------
+ * Acquires a lock if nobody holds it or waits for it.
+ *
+ * Returns: 0 if the lock was acquired, nonzero otherwise, like pthread_mutex_trylock.
+ */
+extern int chlock_trylock(chlock_t *lock);
+
+/*
+ * Function: chlock_unlock
+ * -----------------------
+ * Releases a lock held by the calling thread.
+ */
+extern void chlock_unlock(chlock_t *lock);
+
+#endif
@@ -4,8 +4,11 @@
 
 #include <pthread.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "chan.h"
 #include "waitq.h"
+#include "selgroup.h"
+#include "chpool.h"
 
 /*
  * Array: channel_table
@@ -15,6 +18,15 @@
  */
 static chan_t *channel_table[MAX_CHANNELS] = { 0 };
 
+/*
+ * Array: handle_table
+ * -------------------
+ * This is the table of the handles of the channels (see chan_handle), by
+ * descriptor. Unlike the channels, the handles are never freed: a handle
+ * marked closed keeps answering after its channel is gone.
+ */
+static chan_handle_t handle_table[MAX_CHANNELS];
+
 
 /*
  * Variable: next_channel
@@ -31,6 +43,46 @@ static int next_channel = 1;
  */
 static pthread_mutex_t channel_table_mutex;
 
+/*
+ * Function: lock_kind
+ * -------------------
+ * This function returns the kind of channel lock that creation flags ask for.
+ */
+static int lock_kind(int flags) {
+    return (flags & CHAN_LOCK_TICKET) ? CHLOCK_TICKET :
+           (flags & CHAN_LOCK_MCS) ? CHLOCK_MCS : CHLOCK_MUTEX;
+}
+
+/*
+ * Function: publish_chan
+ * ----------------------
+ * This function applies the CHAN_* flags that concern the channel rather than
+ * its buffer (CHAN_COMBINING) to a new channel and adds it to the channel table.
+ * The channel or its buffer may be NULL if their creation failed.
+ * Returns the identifier of the channel, or -1 on failure, including when
+ * the channel table is full.
+ */
+static int publish_chan(chan_t *chan, int flags) {
+    int cd;
+    if (!chan || !chan->cb) {
+        del_chan(chan);
+        return -1;
+    }
+    chan->combining = (flags & CHAN_COMBINING) != 0;
+    pthread_mutex_lock(&channel_table_mutex);
+    // Descriptors are not reused: once the table is used up, creation fails
+    if (next_channel >= MAX_CHANNELS) {
+        pthread_mutex_unlock(&channel_table_mutex);
+        del_chan(chan);
+        return -1;
+    }
+    cd = next_channel++;
+    chan_init_handle(chan, &handle_table[cd], cd);
+    __atomic_store_n(&channel_table[cd], chan, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&channel_table_mutex);
+    return cd;
+}
+
 /*
  * Function: make_chan
  * ---------------------
@@ -38,15 +90,128 @@ static pthread_mutex_t channel_table_mutex;
  * It locks the channel table mutex to prevent conflicts, then initializes 
  * the new channel with a buffer of size 'len', empty queues for 
  * message sending and receiving, and a new mutex.
- * Returns the identifier of the created channel.
+ * Returns the identifier of the created channel, or -1 on failure.
  */
 int make_chan(size_t len) {
-    int cd;
-    pthread_mutex_lock(&channel_table_mutex);
-    cd = next_channel++;
-    channel_table[cd] = new_chan(len);
-    pthread_mutex_unlock(&channel_table_mutex);
-    return cd;
+    return publish_chan(new_chan(len, CHLOCK_MUTEX), 0);
+}
+
+/*
+ * Function: add_chan
+ * ------------------
+ * This function creates a new channel around the buffer 'cb' and adds it to
+ * the channel table. It is the common tail of the make_* constructors of the
+ * special channel kinds. The buffer may be NULL if its creation failed.
+ * 'flags' holds the CHAN_* flags that concern the channel rather than its
+ * buffer: CHAN_COMBINING and the lock kind. They are applied before the
+ * channel is published.
+ * Returns the identifier of the created channel, or -1 on failure.
+ */
+int add_chan(cbuff_t *cb, int flags) {
+    return publish_chan(new_chan_cb(cb, lock_kind(flags)), flags);
+}
+
+/*
+ * Function: make_chan_flags
+ * -------------------------
+ * This function creates a new channel of size 'len' with an overflow policy:
+ * with CHAN_DROP_NEWEST a send on a full channel discards its value, with
+ * CHAN_DROP_OLDEST it overwrites the oldest buffered value. Either way the send
+ * completes and the discarded value is counted (see dropped_chan). CHAN_COMBINING
+ * can be or'ed with either, or used alone, to send through flat combining, and so
+ * can one of CHAN_LOCK_TICKET and CHAN_LOCK_MCS to pick the channel lock.
+ * Returns the identifier of the created channel, or -1 on invalid flags.
+ */
+int make_chan_flags(size_t len, int flags) {
+    chan_t *chan;
+    int policy = flags & ~(CHAN_COMBINING | CHAN_LOCK_TICKET | CHAN_LOCK_MCS);
+
+    if (policy != 0 && policy != CHAN_DROP_NEWEST && policy != CHAN_DROP_OLDEST)
+        return -1;
+    if ((flags & CHAN_LOCK_TICKET) && (flags & CHAN_LOCK_MCS))
+        return -1;
+    if ((chan = new_chan(len ? len : 1, lock_kind(flags))) != NULL)
+        chan->cb->policy = (policy == CHAN_DROP_NEWEST) ? CB_DROP_NEWEST :
+                           (policy == CHAN_DROP_OLDEST) ? CB_DROP_OLDEST : CB_BLOCK;
+    return publish_chan(chan, flags);
+}
+
+/*
+ * Function: make_chan_keyed
+ * -------------------------
+ * This function creates a new conflating channel of 'len' keys: a send with a
+ * key already pending replaces its value in place, and receives deliver the keys
+ * in the order they became pending.
+ * Returns the identifier of the created channel, or -1 on failure.
+ */
+int make_chan_keyed(size_t len) {
+    return add_chan(cb_init_keyed(len ? len : 1), 0);
+}
+
+/*
+ * Function: make_chan_prio
+ * ------------------------
+ * This function creates a new priority channel of size 'len': receives get the
+ * value sent with the highest priority first, and values of equal priority in
+ * the order they were sent.
+ * Returns the identifier of the created channel, or -1 on failure.
+ */
+int make_chan_prio(size_t len) {
+    return add_chan(cb_init_prio(len ? len : 1), 0);
+}
+
+/*
+ * Function: make_chan_spill
+ * -------------------------
+ * This function creates a new channel whose buffer of size 'len' overflows to
+ * disk: once it is full, sends append to an unnamed memory mapped file in the
+ * directory 'dir', up to 'max_bytes', and receives read the spilled values back
+ * in order. Returns the identifier of the created channel, or -1 if the spill
+ * file could not be created.
+ */
+int make_chan_spill(size_t len, const char *dir, size_t max_bytes) {
+    return add_chan(cb_init_spill(len ? len : 1, dir, max_bytes), 0);
+}
+
+/*
+ * Function: make_chan_unbounded
+ * -----------------------------
+ * This function creates a new channel without a capacity limit: sends never
+ * block. Its buffer is a list of fixed size chunks that grows one chunk at a
+ * time and gives the chunks back as it drains, keeping a few for reuse.
+ * Returns the identifier of the created channel, or -1 on failure.
+ */
+int make_chan_unbounded(void) {
+    return add_chan(cb_init_chunked(), 0);
+}
+
+/*
+ * Function: make_chan_sharded
+ * ---------------------------
+ * This function creates a new channel of size 'len' split in 'shards' per-core
+ * sub-queues (one per online CPU if 'shards' is 0). Sends push to the sub-queue
+ * of the current core and receives pop from it first, then steal from the others,
+ * without the channel lock. Order is FIFO within a sub-queue only.
+ * Returns the identifier of the created channel, or -1 on failure.
+ */
+int make_chan_sharded(size_t len, size_t shards) {
+    long ncpu;
+
+    if (shards == 0)
+        shards = ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0) ? (size_t)ncpu : 1;
+    return add_chan(cb_init_sharded(len ? len : 1, shards), 0);
+}
+
+/*
+ * Function: make_chan_typed
+ * -------------------------
+ * This function creates a new channel of size 'len' whose buffer stores elements
+ * of 'elem_size' bytes instead of any_t values. The any_t of an operation on it
+ * points to the element (see LC_DEFINE_CHAN).
+ * Returns the identifier of the created channel, or -1 on failure.
+ */
+int make_chan_typed(size_t len, size_t elem_size) {
+    return add_chan(cb_init_typed(len ? len : 1, elem_size), 0);
 }
 
 /*
@@ -75,17 +240,21 @@ int close_chan(int cd) {
     int ret;
     chan_t *chan;
     pthread_mutex_lock(&channel_table_mutex);
-    chan = channel_table[cd];
+    chan = get_channel_from_table(cd);
     if (chan) {
-        pthread_mutex_lock(&(chan->mutex));
+        chlock_lock(&(chan->lock));
         if (is_closeable(chan)) {
-            channel_table[cd] = NULL;
+            selgroup_detach(chan);
+            __atomic_store_n(&(handle_table[cd].closed), 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&channel_table[cd], NULL, __ATOMIC_RELEASE);
+            // The lock is part of the channel: release it before freeing the channel
+            chlock_unlock(&(chan->lock));
             del_chan(chan);
             ret = 0;
         } else {
+            chlock_unlock(&(chan->lock));
             ret = -1;
         }
-        pthread_mutex_unlock(&(chan->mutex));
     } else {
         ret = -1;
     }
@@ -97,14 +266,28 @@ int close_chan(int cd) {
  * Function: get_channel_from_table
  * -------------------------------
  * This function returns a pointer to the channel corresponding to the 'cd' 
- * identifier in the channel table.
+ * identifier in the channel table, or NULL if there is none. The entries are
+ * only written with channel_table_mutex held, with release stores, so that the
+ * lookup, done on every operation, reads them without the mutex.
  */
 chan_t *get_channel_from_table(int cd) {
-    chan_t *chan;
-    pthread_mutex_lock(&channel_table_mutex);
-    chan = channel_table[cd];
-    pthread_mutex_unlock(&channel_table_mutex);
-    return chan;
+    if (cd <= 0 || cd >= MAX_CHANNELS)
+        return NULL;
+    return __atomic_load_n(&channel_table[cd], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Function: chan_handle
+ * ---------------------
+ * This function returns the handle of a channel, for the inline chan_try_send and
+ * chan_try_recv of libchannel.h. The handle outlives the channel: once the channel
+ * is closed, it reports it closed.
+ *
+ * Returns:
+ *    The handle, or NULL if the channel does not exist.
+ */
+chan_handle_t *chan_handle(int cd) {
+    return get_channel_from_table(cd) ? &handle_table[cd] : NULL;
 }
 
 int init_channel_pool(void) {
@@ -5,6 +5,8 @@
 
 extern chan_t *get_channel_from_table(int);
 
+extern int add_chan(cbuff_t *cb, int flags);
+
 extern int init_channel_pool();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ctx.h"
+#include "chan.h"
+#include "atomic.h"
+#include "cvpool.h"
+
+/*
+ * `struct ctx` is a cancellation context. 'waiters' is the list of the operations
+ * blocked under the context, protected by 'mutex'. The tree links ('parent',
+ * 'children', 'next', 'prev') are protected by ctx_tree_mutex.
+ */
+struct ctx {
+    pthread_mutex_t mutex;
+    atomic_int      cancelled;
+    ctx_wait_t     *waiters;
+
+    struct ctx *parent;
+    struct ctx *children;
+    struct ctx *next;
+    struct ctx *prev;
+};
+
+/*
+ * Mutex: ctx_tree_mutex
+ * ---------------------
+ * Protects the links between parent and child contexts. Taken before the mutex of
+ * any context.
+ */
+static pthread_mutex_t ctx_tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Function: ctx_create
+ * --------------------
+ * Creates a context, child of 'parent' if it is not NULL. The child of a cancelled
+ * context starts cancelled.
+ */
+ctx_t *ctx_create(ctx_t *parent) {
+    ctx_t *ctx = calloc(1, sizeof(ctx_t));
+
+    if (!ctx)
+        return NULL;
+    pthread_mutex_init(&(ctx->mutex), NULL);
+    atomic_init(&(ctx->cancelled), 0);
+
+    if (parent) {
+        pthread_mutex_lock(&ctx_tree_mutex);
+        ctx->parent = parent;
+        ctx->next = parent->children;
+        if (parent->children)
+            parent->children->prev = ctx;
+        parent->children = ctx;
+        atomic_store(&(ctx->cancelled), atomic_load(&(parent->cancelled)));
+        pthread_mutex_unlock(&ctx_tree_mutex);
+    }
+    return ctx;
+}
+
+/*
+ * Function: ctx_cancel_tree
+ * -------------------------
+ * Cancels a context and its descendants. Every waiter registered on them is
+ * claimed with CV_CANCELLED_CHANNEL_DESCRIPTOR and its wakeup queued, unless a
+ * channel claimed it first. Called with ctx_tree_mutex held.
+ */
+static void ctx_cancel_tree(ctx_t *ctx) {
+    ctx_wait_t *w;
+    condvar_t  *cv;
+    ctx_t      *child;
+    int expected;
+
+    pthread_mutex_lock(&(ctx->mutex));
+    atomic_store(&(ctx->cancelled), 1);
+    while ((w = ctx->waiters) != NULL) {
+        ctx->waiters = w->next;
+        cv = w->cv;
+        w->cv = NULL;
+
+        expected = CV_NULL_CHANNEL_DESCRIPTOR;
+        if (atomic_compare_exchange_strong(&(cv->cd), &expected, CV_CANCELLED_CHANNEL_DESCRIPTOR))
+            wake_waiter(cv);
+        else if (ATOMIC_DEC(&(cv->ref)) == 0)
+            release_condvar(&cv);
+    }
+    pthread_mutex_unlock(&(ctx->mutex));
+
+    for (child = ctx->children; child; child = child->next)
+        ctx_cancel_tree(child);
+}
+
+/*
+ * Function: ctx_cancel
+ * --------------------
+ * Cancels a context and all its descendants, waking every operation blocked under
+ * them. Cancelling twice is harmless.
+ */
+void ctx_cancel(ctx_t *ctx) {
+    if (!ctx)
+        return;
+    pthread_mutex_lock(&ctx_tree_mutex);
+    ctx_cancel_tree(ctx);
+    pthread_mutex_unlock(&ctx_tree_mutex);
+    run_deferred();
+}
+
+/*
+ * Function: ctx_cancelled
+ * -----------------------
+ * Returns 1 if the context was cancelled, 0 otherwise.
+ */
+int ctx_cancelled(ctx_t *ctx) {
+    return ctx && atomic_load(&(ctx->cancelled));
+}
+
+/*
+ * Function: ctx_free
+ * ------------------
+ * Detaches a context from its parent and frees it. Its children become roots. No
+ * operation may be blocked under the context.
+ */
+void ctx_free(ctx_t *ctx) {
+    ctx_t *child;
+
+    if (!ctx)
+        return;
+    pthread_mutex_lock(&ctx_tree_mutex);
+    if (ctx->prev)
+        ctx->prev->next = ctx->next;
+    else if (ctx->parent)
+        ctx->parent->children = ctx->next;
+    if (ctx->next)
+        ctx->next->prev = ctx->prev;
+    while ((child = ctx->children) != NULL) {
+        ctx->children = child->next;
+        child->parent = NULL;
+        child->next = NULL;
+        child->prev = NULL;
+    }
+    pthread_mutex_unlock(&ctx_tree_mutex);
+
+    pthread_mutex_destroy(&(ctx->mutex));
+    free(ctx);
+}
+
+int ctx_register(ctx_t *ctx, ctx_wait_t *w, condvar_t *cv) {
+    pthread_mutex_lock(&(ctx->mutex));
+    if (atomic_load(&(ctx->cancelled))) {
+        pthread_mutex_unlock(&(ctx->mutex));
+        return -1;
+    }
+    ATOMIC_INC(&(cv->ref));
+    w->cv = cv;
+    w->prev = NULL;
+    w->next = ctx->waiters;
+    if (ctx->waiters)
+        ctx->waiters->prev = w;
+    ctx->waiters = w;
+    pthread_mutex_unlock(&(ctx->mutex));
+    return 0;
+}
+
+void ctx_unregister(ctx_t *ctx, ctx_wait_t *w) {
+    condvar_t *cv;
+
+    pthread_mutex_lock(&(ctx->mutex));
+    if ((cv = w->cv) != NULL) {
+        if (w->prev)
+            w->prev->next = w->next;
+        else
+            ctx->waiters = w->next;
+        if (w->next)
+            w->next->prev = w->prev;
+        w->cv = NULL;
+    }
+    pthread_mutex_unlock(&(ctx->mutex));
+
+    if (cv && ATOMIC_DEC(&(cv->ref)) == 0)
+        release_condvar(&cv);
+}
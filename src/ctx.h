@@ -0,0 +1,58 @@
+/*
+ * File: ctx.h
+ * ----------------------------
+ * This header file includes the internal interface of cancellation contexts.
+ *
+ * A blocking operation run under a context registers its condition variable on the
+ * context while it waits. Cancelling the context claims every registered condition
+ * variable with CV_CANCELLED_CHANNEL_DESCRIPTOR and wakes its waiter, the same way a
+ * channel claims it with its descriptor.
+ *
+ * Functions:
+ * ctx_register: Registers a waiting condition variable on a context.
+ * ctx_unregister: Withdraws a registration once the wait is over.
+ */
+#ifndef _LC_CTX_H
+#define _LC_CTX_H 1
+
+#include "libchannel.h"
+#include "waitq.h"
+
+/*
+ * `ctx_wait_t` is a registration of a condition variable on a context. It lives on
+ * the stack of the waiter; 'cv' is reset to NULL once the context let go of it.
+ */
+typedef struct ctx_wait {
+    condvar_t       *cv;
+    struct ctx_wait *next;
+    struct ctx_wait *prev;
+} ctx_wait_t;
+
+/*
+ * Function: ctx_register
+ * ----------------------
+ * Registers a condition variable on a context, which takes a reference on it.
+ *
+ * Parameters:
+ *    ctx - the context.
+ *    w - the registration, owned by the caller until ctx_unregister returns.
+ *    cv - the condition variable the caller waits on.
+ *
+ * Returns:
+ *    0 on success, -1 if the context is already cancelled (nothing is registered).
+ */
+extern int ctx_register(ctx_t *ctx, ctx_wait_t *w, condvar_t *cv);
+
+/*
+ * Function: ctx_unregister
+ * ------------------------
+ * Withdraws a registration, if the context did not already consume it, and drops
+ * the reference of the context on the condition variable.
+ *
+ * Parameters:
+ *    ctx - the context.
+ *    w - the registration passed to ctx_register.
+ */
+extern void ctx_unregister(ctx_t *ctx, ctx_wait_t *w);
+
+#endif
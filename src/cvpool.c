@@ -1,6 +1,12 @@
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "waitq.h"
 #include "chan.h"
+#include "cvpool.h"
+#include "task.h"
+#include "atomic.h"
+#include "alloc.h"
 
 /*
  * Global Variable: condvar_pool
@@ -23,6 +29,15 @@ static int condvar_pool_max;
  */
 static pthread_mutex_t condvar_pool_mutex;
 
+/*
+ * Global Variables: parker_key, parker_once
+ * -----------------------------------------
+ * Thread-specific key holding the parker eventfd of each thread (stored as fd + 1),
+ * so the descriptor is closed when the thread exits.
+ */
+static pthread_key_t  parker_key;
+static pthread_once_t parker_once = PTHREAD_ONCE_INIT;
+
 /*
  * Function: alloc_condvar
  * -----------------------
@@ -36,7 +51,7 @@ static pthread_mutex_t condvar_pool_mutex;
  *    If the function fails to allocate memory, it returns NULL.
  */
 static condvar_t *alloc_condvar() {
-    condvar_t *cv = calloc(1, sizeof(condvar_t));
+    condvar_t *cv = lc_calloc(sizeof(condvar_t));
     if (!cv) {
         return NULL;
     }
@@ -46,6 +61,10 @@ static condvar_t *alloc_condvar() {
     pthread_mutex_init(&(cv->mutex), NULL);
     atomic_init(&(cv->ref), 0);
     atomic_init(&(cv->cd), CV_NULL_CHANNEL_DESCRIPTOR);
+    cv->efd = -1;
+    cv->task = NULL;
+    cv->async = NULL;
+    cv->next_wake = NULL;
     // Other members of condvar_t can be initialized here as needed.
 
     return cv;
@@ -71,7 +90,7 @@ static void free_condvar(condvar_t **cv) {
     pthread_cond_destroy(&((*cv)->pcond));
     pthread_mutex_destroy(&((*cv)->mutex));
 
-    free(*cv);
+    lc_free(*cv, sizeof(condvar_t));
     *cv = NULL;
 }
 
@@ -110,6 +129,9 @@ condvar_t *empty_condvar() {
 void release_condvar(condvar_t **cv) {
     atomic_init(&((*cv)->ref), 0);
     atomic_init(&((*cv)->cd), CV_NULL_CHANNEL_DESCRIPTOR);
+    (*cv)->efd = -1;
+    (*cv)->task = NULL;
+    (*cv)->async = NULL;
     pthread_mutex_lock(&condvar_pool_mutex);
     if (condvar_pool.len == condvar_pool_max) {
         free_condvar(cv);
@@ -137,4 +159,182 @@ int init_condvar_pool(int pool_max) {
     condvar_pool.tail = NULL;
     condvar_pool.len = 0;
     return pthread_mutex_init(&condvar_pool_mutex, NULL);
-}
\ No newline at end of file
+}
+
+/*
+ * Function: prewarm_condvar_pool
+ * ------------------------------
+ * Fills the condition variable pool with up to 'count' condition variables (no more
+ * than its maximum size), so that the first waits do not allocate.
+ *
+ * Parameters:
+ *    count - The number of condition variables to create.
+ *
+ * Returns:
+ *    Returns 0 on success, and -1 if memory runs out.
+ */
+int prewarm_condvar_pool(size_t count) {
+    condvar_t *cv;
+    int ret = 0;
+
+    pthread_mutex_lock(&condvar_pool_mutex);
+    while ((size_t)condvar_pool.len < count && condvar_pool.len < condvar_pool_max) {
+        if (!(cv = alloc_condvar()) || enqueue(&condvar_pool, cv) != 0) {
+            free_condvar(&cv);
+            ret = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&condvar_pool_mutex);
+    return ret;
+}
+
+/*
+ * Function: close_parker
+ * ----------------------
+ * Thread-specific data destructor that closes the parker eventfd of an exiting thread.
+ */
+static void close_parker(void *value) {
+    close((int)(intptr_t)value - 1);
+}
+
+static void make_parker_key(void) {
+    pthread_key_create(&parker_key, close_parker);
+}
+
+/*
+ * Function: thread_parker_fd
+ * --------------------------
+ * Returns the parker eventfd of the calling thread, creating it on first use. A thread
+ * that waits on channels and file descriptors at the same time polls this descriptor,
+ * and wakers write to it instead of signaling the condition variable.
+ *
+ * Parameters:
+ *    None.
+ *
+ * Returns:
+ *    The non-blocking eventfd of the calling thread, or -1 if it could not be created.
+ */
+int thread_parker_fd(void) {
+    void *value;
+    int fd;
+
+    pthread_once(&parker_once, make_parker_key);
+    if ((value = pthread_getspecific(parker_key)) != NULL)
+        return (int)(intptr_t)value - 1;
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd >= 0 && pthread_setspecific(parker_key, (void *)(intptr_t)(fd + 1)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/*
+ * Thread-local Variables: deferred_wakes, deferred_async
+ * ------------------------------------------------------
+ * Waiters woken by this thread while it holds channel locks. Parked threads and
+ * tasks are only signaled from `run_deferred`, once the locks are released, so that
+ * they do not wake up straight into a lock that is still held. Asynchronous
+ * operations are completed there too, because a continuation usually performs more
+ * channel operations. Each condition variable in deferred_wakes carries the
+ * reference of the waker that claimed it.
+ */
+static __thread condvar_t *deferred_wakes = NULL;
+static __thread chan_async_t *deferred_async = NULL;
+
+/*
+ * Function: signal_waiter
+ * -----------------------
+ * This function wakes the thread parked on a condition variable. Threads blocked in
+ * select_chan_fds park on their eventfd (cv->efd) instead of the condition variable,
+ * so they are woken by writing to that descriptor. Tasks are made runnable again on
+ * the task runtime.
+ *
+ * Parameters:
+ * - cv: A pointer to the condition variable of the waiting thread.
+ *
+ * Returns: void
+ */
+static void signal_waiter(condvar_t *cv) {
+    pthread_mutex_lock(&(cv->mutex));
+    if (cv->task)
+        task_wake(cv->task);
+    else if (cv->efd >= 0)
+        eventfd_write(cv->efd, 1);
+    else
+        pthread_cond_signal(&(cv->pcond));
+    pthread_mutex_unlock(&(cv->mutex));
+}
+
+/*
+ * Function: wake_waiter
+ * ---------------------
+ * This function queues the wakeup of a condition variable whose channel descriptor
+ * the caller just claimed, and takes over the caller's reference on it. The waiter
+ * is signaled by `run_deferred`; an asynchronous operation is queued for completion
+ * and the reference dropped at once.
+ *
+ * Parameters:
+ * - cv: A pointer to the condition variable of the waiter.
+ *
+ * Returns: void
+ */
+void wake_waiter(condvar_t *cv) {
+    if (cv->async) {
+        cv->async->next = deferred_async;
+        deferred_async = cv->async;
+        if (ATOMIC_DEC(&(cv->ref)) == 0)
+            release_condvar(&cv);
+        return;
+    }
+    cv->next_wake = deferred_wakes;
+    deferred_wakes = cv;
+}
+
+/*
+ * Function: run_deferred
+ * ----------------------
+ * This function signals the waiters woken by the calling thread, then runs the
+ * continuations of the asynchronous operations it woke, in the order they were
+ * woken. Continuations may wake more waiters, which are handled in the next round.
+ *
+ * Returns: void
+ */
+void run_deferred(void) {
+    condvar_t *cv;
+    condvar_t *wakes;
+    chan_async_t *list;
+    chan_async_t *op;
+    chan_async_t *ordered;
+
+    while (deferred_wakes || deferred_async) {
+        // Detach the whole batch first: signaling may run code that wakes more
+        for (wakes = NULL; (cv = deferred_wakes) != NULL; ) {
+            deferred_wakes = cv->next_wake;
+            cv->next_wake = wakes;
+            wakes = cv;
+        }
+        while ((cv = wakes) != NULL) {
+            wakes = cv->next_wake;
+            cv->next_wake = NULL;
+            signal_waiter(cv);
+            if (ATOMIC_DEC(&(cv->ref)) == 0)
+                release_condvar(&cv);
+        }
+
+        list = deferred_async;
+        deferred_async = NULL;
+        for (ordered = NULL; list; list = op) {
+            op = list->next;
+            list->next = ordered;
+            ordered = list;
+        }
+        while ((op = ordered) != NULL) {
+            ordered = op->next;
+            op->next = NULL;
+            op->ready(op);
+        }
+    }
+}
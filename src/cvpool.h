@@ -5,7 +5,29 @@
 
 extern int init_condvar_pool(int pool_max);
 
+extern int prewarm_condvar_pool(size_t count);
+
 extern void release_condvar(condvar_t **cv);
 
 extern condvar_t *empty_condvar();
+
+extern int thread_parker_fd(void);
+
+/*
+ * Function: wake_waiter
+ * ---------------------
+ * Queues the wakeup of a condition variable whose descriptor the caller claimed,
+ * taking over the caller's reference on it. The waiter (thread, task or eventfd) is
+ * signaled by run_deferred, after the caller released its channel locks.
+ */
+extern void wake_waiter(condvar_t *cv);
+
+/*
+ * Function: run_deferred
+ * ----------------------
+ * Signals the waiters woken by the calling thread, then runs the continuations of
+ * the asynchronous operations it woke. Must be called without holding channel locks,
+ * after every operation that may have woken a waiter.
+ */
+extern void run_deferred(void);
 #endif 
\ No newline at end of file
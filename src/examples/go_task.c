@@ -0,0 +1,60 @@
+/*
+package main
+
+import "fmt"
+
+func main() {
+	results := make(chan int, 16)
+
+	for i := 0; i < 1000; i++ {
+		go func(id int) {
+			results <- id * id
+		}(i)
+	}
+
+	sum := 0
+	for i := 0; i < 1000; i++ {
+		sum += <-results
+	}
+	fmt.Println("sum:", sum)
+}
+*/
+
+#include <libchannel.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define NTASKS 1000
+
+int results;
+
+void *square(void *arg) {
+    any_t v;
+    int64_t id = (intptr_t)arg;
+    v.type = VAR_INT64;
+    v.value.int64_val = id * id;
+    // Blocking here parks the task, not the worker thread.
+    send_chan(results, &v);
+    return NULL;
+}
+
+int main(void) {
+    int64_t sum = 0;
+    any_t v;
+    int i;
+
+    init_libchannel();
+    init_task_runtime(0);
+
+    results = make_chan(16);
+
+    for (i = 0; i < NTASKS; i++)
+        go_task(square, (void *)(intptr_t)i);
+
+    for (i = 0; i < NTASKS; i++) {
+        recv_chan(results, &v);
+        sum += v.value.int64_val;
+    }
+    printf("sum: %lld\n", (long long)sum);
+    wait_tasks();
+}
@@ -32,34 +32,30 @@ func main() {
 int main(void) {
     any_t book;
     int bookshelf;
+    chan_handle_t *shelf;
     int i;
     int cap = 3;
     init_libchannel();
     
     bookshelf = make_chan(cap);
+    shelf = chan_handle(bookshelf);
 
     for (i = 0; i < cap * 2; i++) {
-        select_set_t op[] = {
-            {bookshelf, OP_SEND, &book, NULL}
-        };
         book.type = VAR_INT64;
         book.value.int64_val = i;
-        if (select_chan(op, 1, SELECT_NONBLOCK) == bookshelf) {
+        if (chan_try_send(shelf, &book) == bookshelf) {
             printf("success to put book %d\n", i);
         } else {
             printf("failed to put book\n");
         }        
     }
 
-        for (i = 0; i < cap * 2; i++) {
-        select_set_t op[] = {
-            {bookshelf, OP_RECV, NULL, &book}
-        };
-        if (select_chan(op, 1, SELECT_NONBLOCK) == bookshelf) {
+    for (i = 0; i < cap * 2; i++) {
+        if (chan_try_recv(shelf, &book) == bookshelf) {
             printf("success to get book %lld\n", book.value.int64_val);
         } else {
             printf("failed to get book\n");
         }        
     }
 
-}
\ No newline at end of file
+}
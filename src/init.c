@@ -1,7 +1,36 @@
 #include "chpool.h"
 #include "cvpool.h"
+#include "chan.h"
+#include "alloc.h"
+
+/*
+ * Constant: CONDVAR_POOL_MIN
+ * --------------------------
+ * The number of idle condition variables kept for reuse when no prewarming asks
+ * for more.
+ */
+#define CONDVAR_POOL_MIN 10
 
 int init_libchannel(void) {
+    return init_libchannel_prewarm(NULL);
+}
+
+int init_libchannel_prewarm(const lc_prewarm_t *prewarm) {
+    size_t waiters = prewarm ? prewarm->waiters : 0;
     int ret;
-    return (ret = init_channel_pool()) == 0 ? init_condvar_pool(10) : ret;
-}
\ No newline at end of file
+
+    if ((ret = init_channel_pool()) != 0)
+        return ret;
+    if ((ret = init_condvar_pool(waiters > CONDVAR_POOL_MIN ? (int)waiters : CONDVAR_POOL_MIN)) != 0)
+        return ret;
+    if (!prewarm)
+        return 0;
+
+    // A blocked select holds a condition variable, and a wait queue node per channel;
+    // idle condition variables sit in the pool on wait queue nodes too
+    if (prewarm->channels > 0 && lc_prewarm(new_chan_footprint(prewarm->chan_len), prewarm->channels) != 0)
+        return -1;
+    if (waiters > 0 && (prewarm_condvar_pool(waiters) != 0 || lc_prewarm(sizeof(waitq_node_t), 2 * waiters) != 0))
+        return -1;
+    return 0;
+}
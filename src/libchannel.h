@@ -12,6 +12,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* The 'any_t' structure is a generic type that allows storing values of different types.
  * It consists of an 'int type' which indicates the type of the value stored and a union
  * which contains different possible types for the value. It enables users to store
@@ -54,6 +58,13 @@ typedef struct {
 
 #define SELECT_BLOCK    1
 #define SELECT_NONBLOCK 0
+
+/*
+ * Return values of select_chan_fds that do not name a channel
+ */
+#define SELECT_FD_READY  0x7fffffff    // At least one file descriptor is ready
+#define SELECT_FD_ERROR  (-0x7fffffff) // poll() failed, errno is set
+#define SELECT_CANCELLED (-0x7ffffffe) // The cancellation context was cancelled
 #define OP_BLOCK        1
 #define OP_NONBLOCK     0
 /*
@@ -69,17 +80,83 @@ typedef struct {
  *    op_type: The operation type. This should be either OP_SEND or OP_RECV.
  *    send:   A pointer to the data to be sent. This should be NULL for receive operations.
  *    recv:   A pointer to a location where the received data should be stored. This should be NULL for send operations.
+ *    key:    The key sent with the data on a keyed channel (see make_chan_keyed), or its
+ *            priority on a priority channel (see make_chan_prio). A receive stores the
+ *            key or priority of the received data here (0 for other channels).
  */
 typedef struct {
     int cd;
     int op_type;
     any_t *send;
     any_t *recv;
+    uint64_t key;
 } select_set_t;
 
 
 extern int init_libchannel(void);
 
+/*
+ * Structure: lc_allocator_t
+ * -------------------------
+ * An allocator for the memory of channels, their buffers and wait nodes (see
+ * libchannel_set_allocator).
+ *
+ *      alloc: Returns 'size' bytes aligned on 'align' (a power of two), or NULL.
+ *      free: Frees a block returned by alloc, of the given size.
+ *      ctx: Passed to both as is.
+ */
+typedef struct {
+    void *(*alloc)(size_t size, size_t align, void *ctx);
+    void  (*free)(void *ptr, size_t size, void *ctx);
+    void  *ctx;
+} lc_allocator_t;
+
+/*
+ * Function: libchannel_set_allocator
+ * ----------------------------------
+ * This function replaces the allocator behind the memory of channels, their buffers
+ * and wait nodes, or restores the default (posix_memalign and free) if 'a' is NULL.
+ *
+ * The library does not call it for every object: blocks up to 64 KiB come from slab
+ * arenas, whose objects are recycled through per-thread caches, and only the arenas
+ * themselves, and larger blocks, are requested from the allocator. A steady state
+ * therefore makes no allocator call. Arena memory is kept for the life of the process.
+ *
+ * Must be called before init_libchannel.
+ *
+ * Returns:
+ *    0 on success, -1 if the library already allocated memory or 'a' lacks a function.
+ */
+extern int libchannel_set_allocator(const lc_allocator_t *a);
+
+/*
+ * Structure: lc_prewarm_t
+ * -----------------------
+ * What init_libchannel_prewarm allocates ahead of use.
+ *
+ *      channels: The number of channels created with make_chan or make_chan_flags.
+ *      chan_len: Their capacity.
+ *      waiters: The number of waits on a channel at the same time: condition
+ *               variables and wait queue nodes.
+ */
+typedef struct {
+    size_t channels;
+    size_t chan_len;
+    size_t waiters;
+} lc_prewarm_t;
+
+/*
+ * Function: init_libchannel_prewarm
+ * ---------------------------------
+ * This function initializes the library like init_libchannel, then fills the slab
+ * arenas and the pool of condition variables as described by 'prewarm', so that the
+ * first operations do not pay for allocations. 'prewarm' may be NULL.
+ *
+ * Returns:
+ *    0 on success, nonzero on failure.
+ */
+extern int init_libchannel_prewarm(const lc_prewarm_t *prewarm);
+
 
 /*
  * Function: send_chan
@@ -112,6 +189,87 @@ extern int send_chan_bctrl(int cd, any_t *send, int should_block);
  */
 extern int recv_chan(int cd, any_t *recv);
 extern int recv_chan_bctrl(int cd, any_t *recv, int should_block);
+
+/*
+ * Structure: chan_handle_t
+ * ------------------------
+ * The part of a channel that chan_try_send and chan_try_recv read inline, without
+ * calling into the library. Obtained with chan_handle; the library owns it, and it
+ * stays valid for the life of the process, after the channel is closed too. Its
+ * fields are read-only.
+ *
+ *      int cd: The descriptor of the channel.
+ *      int closed: Whether the channel was closed, set before it is freed.
+ *      int fast_send: Whether a send can only complete while len < cap.
+ *      int fast_recv: Whether a receive can only complete while len > 0.
+ *      const size_t *len: The number of values in the channel, updated atomically.
+ *      const size_t *cap: The capacity of the channel, updated atomically.
+ */
+typedef struct chan_handle {
+    int cd;
+    int closed;
+    int fast_send;
+    int fast_recv;
+    const size_t *len;
+    const size_t *cap;
+} chan_handle_t;
+
+/*
+ * Function: chan_handle
+ * ---------------------
+ * This function returns the handle of a channel, for chan_try_send and chan_try_recv.
+ *
+ * Returns:
+ *    The handle, or NULL if the channel does not exist.
+ */
+extern chan_handle_t *chan_handle(int cd);
+
+/*
+ * Function: chan_try_op
+ * ---------------------
+ * This function is the slow path of chan_try_send and chan_try_recv: it performs
+ * the operation without blocking, like send_chan_bctrl and recv_chan_bctrl.
+ */
+extern int chan_try_op(chan_handle_t *h, int op_type, any_t *data);
+
+/*
+ * Functions: chan_try_send, chan_try_recv
+ * ---------------------------------------
+ * These functions send or receive without blocking, like send_chan_bctrl and
+ * recv_chan_bctrl with SELECT_NONBLOCK. They are inlined in the caller: a send on
+ * a full channel or a receive on an empty one fails after reading three words,
+ * without a call into the library or any lock, so that polling loops run at
+ * memory speed. Other calls go through chan_try_op.
+ *
+ * Parameters:
+ *    h    - the handle of the channel (see chan_handle).
+ *    send - a pointer to the data to send.
+ *    recv - a pointer to a location where the received data should be stored.
+ *
+ * Returns:
+ *    The descriptor of the channel if the operation completed, 0 if it could not
+ *    complete now, or the negated descriptor if the channel is closed.
+ *
+ * Note:
+ *    A call made after close_chan returned reports the channel closed. A call that
+ *    races close_chan is undefined, as is any other operation on a channel being
+ *    closed.
+ */
+static inline int chan_try_send(chan_handle_t *h, any_t *send) {
+    if (__atomic_load_n(&(h->closed), __ATOMIC_ACQUIRE))
+        return -(h->cd);
+    if (h->fast_send && __atomic_load_n(h->len, __ATOMIC_RELAXED) >= __atomic_load_n(h->cap, __ATOMIC_RELAXED))
+        return 0;
+    return chan_try_op(h, OP_SEND, send);
+}
+
+static inline int chan_try_recv(chan_handle_t *h, any_t *recv) {
+    if (__atomic_load_n(&(h->closed), __ATOMIC_ACQUIRE))
+        return -(h->cd);
+    if (h->fast_recv && __atomic_load_n(h->len, __ATOMIC_RELAXED) == 0)
+        return 0;
+    return chan_try_op(h, OP_RECV, recv);
+}
 /*
  * Function: select_chan_op
  * ------------------------
@@ -131,6 +289,263 @@ extern int recv_chan_bctrl(int cd, any_t *recv, int should_block);
  */
 extern int select_chan(select_set_t *set, size_t n, int should_block);
 
+/*
+ * Structure: chan_async_t
+ * -----------------------
+ * An asynchronous channel operation, used to integrate channels with event loops and
+ * coroutines without blocking a thread (see select_chan_async).
+ *
+ * Members:
+ *    ready: Called once a channel of the set is ready for the operation. It runs on the
+ *           thread that made the channel ready, after that thread released its channel
+ *           locks. It must call select_chan_async_resume, directly or by posting it to
+ *           an executor of its choice.
+ *    data:  Free for the caller.
+ *    waiter, next: Private to the library.
+ */
+typedef struct chan_async {
+    void (*ready)(struct chan_async *op);
+    void *data;
+    void *waiter;
+    struct chan_async *next;
+} chan_async_t;
+
+struct pollfd;
+
+/*
+ * Function: select_chan_fds
+ * -------------------------
+ * This function waits on a set of channel operations and a set of file descriptors
+ * (sockets, pipes, timerfds...) at the same time, and returns as soon as one of them
+ * is ready. No helper thread is needed: the calling thread parks on a per-thread
+ * eventfd that is polled together with the given descriptors.
+ *
+ * Parameters:
+ * - set: a pointer to an array of `select_set_t` structures (may be NULL if n == 0).
+ * - n: the number of channel operations in the array.
+ * - fds: a pointer to an array of `struct pollfd`, filled in as for poll() (may be NULL if nfds == 0).
+ * - nfds: the number of file descriptors in the array.
+ * - timeout: the maximum time to wait in milliseconds, -1 to wait forever, 0 not to wait.
+ *
+ * Returns:
+ * - The descriptor of the channel whose operation was performed.
+ * - SELECT_FD_READY if at least one file descriptor is ready; check the revents fields.
+ * - 0 if the timeout expired.
+ * - The negated descriptor of a closed channel, as select_chan does.
+ * - SELECT_FD_ERROR if poll() failed; errno is set.
+ */
+extern int select_chan_fds(select_set_t *set, size_t n, struct pollfd *fds, size_t nfds, int timeout);
+
+/*
+ * Function: select_chan_async
+ * ---------------------------
+ * This function starts a select that never blocks the calling thread.
+ *
+ * If one of the operations can be performed now, it is performed. Otherwise the
+ * operation is registered on every channel of the set, costing one wait node per
+ * channel instead of a blocked thread. When a channel becomes ready for it,
+ * op->ready is called; it must complete the operation with select_chan_async_resume.
+ *
+ * Parameters:
+ * - set: a pointer to an array of `select_set_t` structures, at least one. It must
+ *   stay valid until the operation completes.
+ * - n: the number of operations in the array.
+ * - op: the asynchronous operation, with its ready callback set.
+ *
+ * Returns:
+ * - The descriptor of the channel whose operation was performed.
+ * - The negated descriptor of a closed channel.
+ * - -1 if n is 0: there is nothing to wait for, and op->ready is never called.
+ * - 0 if the operation is pending. op->ready may run on another thread even before
+ *   this function returns, so the caller must not touch 'op' after it.
+ */
+extern int select_chan_async(select_set_t *set, size_t n, chan_async_t *op);
+
+/*
+ * Function: select_chan_async_resume
+ * ----------------------------------
+ * This function completes a pending asynchronous select, once op->ready was called,
+ * by performing the operation on the channel that became ready.
+ *
+ * Returns:
+ * The same values as select_chan_async. If 0 is returned, the operation is pending
+ * again and op->ready will be called another time.
+ */
+extern int select_chan_async_resume(select_set_t *set, size_t n, chan_async_t *op);
+
+/*
+ * Type: ctx_t
+ * -----------
+ * A cancellation context. Blocking operations run under a context (select_chan_ctx,
+ * send_chan_ctx, recv_chan_ctx) return SELECT_CANCELLED as soon as the context is
+ * cancelled, so a subsystem can be shut down without sending a sentinel message to
+ * each of its threads. Contexts form a tree: cancelling a context cancels all its
+ * descendants.
+ */
+typedef struct ctx ctx_t;
+
+/*
+ * Function: ctx_create
+ * --------------------
+ * This function creates a cancellation context.
+ *
+ * Parameters:
+ * parent: The parent context, or NULL for a root context. The child of a
+ *         cancelled context starts cancelled.
+ *
+ * Returns:
+ * The new context, or NULL on failure.
+ */
+extern ctx_t *ctx_create(ctx_t *parent);
+
+/*
+ * Function: ctx_cancel
+ * --------------------
+ * This function cancels a context and all its descendants. Every operation blocked
+ * under them is woken up and returns SELECT_CANCELLED; the cost is proportional to
+ * the number of blocked operations. Cancelling a context twice is harmless.
+ */
+extern void ctx_cancel(ctx_t *ctx);
+
+/*
+ * Function: ctx_cancelled
+ * -----------------------
+ * This function returns 1 if the context was cancelled, 0 otherwise.
+ */
+extern int ctx_cancelled(ctx_t *ctx);
+
+/*
+ * Function: ctx_free
+ * ------------------
+ * This function detaches a context from its parent and frees it. Its children
+ * become root contexts. No operation may still be blocked under it.
+ */
+extern void ctx_free(ctx_t *ctx);
+
+/*
+ * Function: select_chan_ctx
+ * -------------------------
+ * This function performs a blocking select under a cancellation context.
+ *
+ * It behaves like select_chan with SELECT_BLOCK, but also returns when the
+ * context is cancelled. An operation that can complete immediately still does,
+ * even under a cancelled context.
+ *
+ * Parameters:
+ * ctx: The cancellation context, or NULL to wait without one.
+ * set: A pointer to an array of `select_set_t` structures.
+ * n: The number of operations in the array.
+ *
+ * Returns:
+ * - The descriptor of the channel whose operation was performed.
+ * - The negated descriptor of a closed channel.
+ * - SELECT_CANCELLED if the context was cancelled first.
+ */
+extern int select_chan_ctx(ctx_t *ctx, select_set_t *set, size_t n);
+
+/*
+ * Function: send_chan_ctx / recv_chan_ctx
+ * ---------------------------------------
+ * These functions send or receive data, blocking until the operation completes
+ * or the context is cancelled.
+ *
+ * Returns:
+ * The channel descriptor on success, its negation if the channel is closed, or
+ * SELECT_CANCELLED if the context was cancelled first.
+ */
+extern int send_chan_ctx(ctx_t *ctx, int cd, any_t *send);
+extern int recv_chan_ctx(ctx_t *ctx, int cd, any_t *recv);
+
+/*
+ * Types: sem_chan_t, waitgroup_t, barrier_t
+ * -----------------------------------------
+ * Synchronization primitives. They are descriptors in the channel table, so they
+ * can be waited on in select_chan together with channel operations, and released
+ * with close_chan. Their counters are updated with atomic operations: acquiring an
+ * available unit, releasing one, or marking a task done takes no lock unless some
+ * thread is waiting on the other side.
+ *
+ * In a select set:
+ * - {sem, OP_RECV, NULL, &token} acquires a unit of a semaphore.
+ * - {sem, OP_SEND, &token, NULL} releases one.
+ * - {wg, OP_RECV, NULL, &token} completes once the counter of a wait group is 0.
+ * Barriers are only waited on with barrier_wait. The token received is a VAR_INT32 0.
+ */
+typedef int sem_chan_t;
+typedef int waitgroup_t;
+typedef int barrier_t;
+
+/*
+ * Function: make_sem
+ * ------------------
+ * This function creates a counting semaphore holding 'initial' units, and at most 'max'.
+ *
+ * Returns:
+ * The descriptor of the semaphore, or -1 on failure.
+ */
+extern sem_chan_t make_sem(size_t initial, size_t max);
+
+/*
+ * Function: sem_acquire / sem_try_acquire / sem_release
+ * -----------------------------------------------------
+ * These functions take a unit of a semaphore, blocking while there is none
+ * (sem_acquire) or failing (sem_try_acquire), and give a unit back, blocking while
+ * the semaphore holds its maximum.
+ *
+ * Returns:
+ * The descriptor of the semaphore on success, 0 if sem_try_acquire found no unit,
+ * or a negative value if the semaphore does not exist.
+ */
+extern int sem_acquire(sem_chan_t sem);
+extern int sem_try_acquire(sem_chan_t sem);
+extern int sem_release(sem_chan_t sem);
+
+/*
+ * Function: make_waitgroup
+ * ------------------------
+ * This function creates a wait group, with a counter of 0.
+ *
+ * Returns:
+ * The descriptor of the wait group, or -1 on failure.
+ */
+extern waitgroup_t make_waitgroup(void);
+
+/*
+ * Function: wg_add / wg_done / wg_wait
+ * ------------------------------------
+ * wg_add adds delta to the counter of a wait group and wg_done decrements it; when
+ * it drops to 0, every waiter is woken at once. wg_wait blocks until the counter is 0.
+ *
+ * Returns:
+ * wg_add and wg_done return 0 on success, -1 if the wait group does not exist or
+ * its counter would become negative. wg_wait returns the descriptor of the wait
+ * group, or a negative value if it does not exist.
+ */
+extern int wg_add(waitgroup_t wg, int delta);
+extern int wg_done(waitgroup_t wg);
+extern int wg_wait(waitgroup_t wg);
+
+/*
+ * Function: make_barrier
+ * ----------------------
+ * This function creates a reusable barrier for 'parties' threads.
+ *
+ * Returns:
+ * The descriptor of the barrier, or -1 on failure.
+ */
+extern barrier_t make_barrier(size_t parties);
+
+/*
+ * Function: barrier_wait
+ * ----------------------
+ * This function blocks until 'parties' threads called it on the barrier.
+ *
+ * Returns:
+ * 1 for the last thread to arrive, 0 for the others, or a negative value if the
+ * barrier does not exist.
+ */
+extern int barrier_wait(barrier_t barrier);
+
 /*
  * Function: make_chan
  * ---------------------
@@ -142,6 +557,281 @@ extern int select_chan(select_set_t *set, size_t n, int should_block);
  */
 extern int make_chan(size_t len);
 
+/*
+ * Constants: channel flags
+ * ------------------------
+ * Overflow policies and send modes for make_chan_flags.
+ *
+ * CHAN_DROP_NEWEST: a send on a full channel discards the value sent.
+ * CHAN_DROP_OLDEST: a send on a full channel overwrites the oldest buffered value,
+ *                   so the channel behaves as a ring of the latest values.
+ * CHAN_COMBINING:   send_chan publishes its value instead of queueing on the channel
+ *                   lock; whichever sender holds the lock applies every published
+ *                   send in one pass (flat combining). Meant for channels fed by
+ *                   many producers at once. May be or'ed with a drop policy.
+ * CHAN_LOCK_TICKET: the channel lock is a ticket lock instead of a pthread mutex:
+ *                   contenders spin instead of sleeping and get the lock in
+ *                   arrival order.
+ * CHAN_LOCK_MCS:    the channel lock is an MCS queue lock: contenders spin on a
+ *                   flag of their own, so a hand-over only touches the cache of the
+ *                   next one, and get the lock in arrival order.
+ *                   The spinning locks pay off for short critical sections with
+ *                   contenders on other cores; the default mutex is the better
+ *                   choice when threads outnumber cores. At most one lock flag
+ *                   may be given, or'ed with the other flags.
+ */
+#define CHAN_DROP_NEWEST 0x1
+#define CHAN_DROP_OLDEST 0x2
+#define CHAN_COMBINING   0x4
+#define CHAN_LOCK_TICKET 0x8
+#define CHAN_LOCK_MCS    0x10
+
+/*
+ * Function: make_chan_flags
+ * -------------------------
+ * This function creates a new channel of size 'len' with an overflow policy,
+ * for feeds such as telemetry where losing samples beats blocking the producer.
+ *
+ * Sends on such a channel always complete in constant time: they lock the
+ * channel alone, without the lock ordering and wait queue setup of select_chan,
+ * and never block. Dropped values are counted, see dropped_chan. The library
+ * does not free the memory a dropped VAR_POINTER refers to.
+ *
+ * Parameters:
+ * len: The capacity of the channel.
+ * flags: 0, CHAN_DROP_NEWEST or CHAN_DROP_OLDEST, optionally or'ed with CHAN_COMBINING
+ *        and with one of CHAN_LOCK_TICKET and CHAN_LOCK_MCS.
+ *
+ * Returns:
+ * The identifier of the created channel, or -1 on failure.
+ */
+extern int make_chan_flags(size_t len, int flags);
+
+/*
+ * Function: make_chan_keyed
+ * -------------------------
+ * This function creates a conflating channel that holds at most 'len' keys.
+ *
+ * A send with a key (send_chan_key, or the 'key' member of select_set_t)
+ * replaces the pending value with the same key in place, if there is one, and
+ * otherwise queues the value. Receives deliver the keys in the order they first
+ * became pending, each with its latest value, so a slow consumer only does work
+ * per distinct key and not per update. Replaced values are counted by dropped_chan.
+ *
+ * Returns:
+ * The identifier of the created channel, or -1 on failure.
+ */
+extern int make_chan_keyed(size_t len);
+
+/*
+ * Function: send_chan_key
+ * -----------------------
+ * This function sends data with a key, blocking while a keyed channel is full
+ * and the key is not pending. Other channels ignore the key.
+ *
+ * Returns:
+ * The same values as send_chan.
+ */
+extern int send_chan_key(int cd, uint64_t key, any_t *send);
+
+/*
+ * Function: recv_chan_key
+ * -----------------------
+ * This function receives data and its key from a channel (0 for channels
+ * without keys).
+ *
+ * Returns:
+ * The same values as recv_chan.
+ */
+extern int recv_chan_key(int cd, uint64_t *key, any_t *recv);
+
+/*
+ * Function: make_chan_prio
+ * ------------------------
+ * This function creates a priority channel of size 'len'.
+ *
+ * Its buffer is a 4-ary heap: a receive always gets the pending value of
+ * highest priority, in O(log n), and values of equal priority in the order
+ * they were sent. Priorities are given by send_chan_prio or by the 'key'
+ * member of select_set_t, so priority channels work in select_chan like
+ * any other channel. A receive stores the priority of its value in 'key'.
+ *
+ * Returns:
+ * The identifier of the created channel, or -1 on failure.
+ */
+extern int make_chan_prio(size_t len);
+
+/*
+ * Function: send_chan_prio
+ * ------------------------
+ * This function sends data with a priority (higher is more urgent), blocking
+ * while the channel is full.
+ *
+ * Returns:
+ * The same values as send_chan.
+ */
+extern int send_chan_prio(int cd, uint64_t prio, any_t *send);
+
+/*
+ * Function: dropped_chan
+ * ----------------------
+ * This function returns the number of values a channel created with
+ * make_chan_flags discarded because it was full, or the number of values a
+ * keyed channel replaced by newer ones.
+ */
+extern uint64_t dropped_chan(int cd);
+
+/*
+ * Function: make_chan_spill
+ * -------------------------
+ * This function creates a new channel whose in-memory buffer overflows to disk.
+ *
+ * Once the 'len' slots of the buffer are full, sends append to a memory mapped,
+ * unnamed file created in the directory 'dir' instead of blocking, until the
+ * file holds 'max_bytes'. Receivers get the spilled values back in FIFO order.
+ * Spilling costs a memory copy into the page cache, so producers keep running
+ * at close to memory speed through bursts larger than the RAM they may use.
+ * The file is removed when the channel is closed.
+ *
+ * Values are spilled as they are: a VAR_POINTER still points into the memory of
+ * the process, only the any_t itself goes to disk.
+ *
+ * Parameters:
+ * len: The number of values kept in memory.
+ * dir: The directory of the spill file (e.g. "/var/tmp").
+ * max_bytes: The maximum size of the spill file.
+ *
+ * Returns:
+ * The identifier of the created channel, or -1 on failure.
+ */
+extern int make_chan_spill(size_t len, const char *dir, size_t max_bytes);
+
+/*
+ * Function: make_chan_unbounded
+ * -----------------------------
+ * This function creates a new channel without a capacity limit, for queues
+ * where blocking a sender is not acceptable. Sends only fail if memory runs out.
+ *
+ * The buffer is a linked list of fixed size chunks: it grows one chunk at a
+ * time without copying the queued values, and frees its chunks as it drains,
+ * keeping a few of them to absorb the next burst. cap() reports INT_MAX.
+ *
+ * Returns:
+ * The identifier of the created channel, or -1 on failure.
+ */
+extern int make_chan_unbounded(void);
+
+/*
+ * Function: make_chan_sharded
+ * ---------------------------
+ * This function creates a new channel for task distribution between many producers
+ * and many consumers. Its buffer of size 'len' is split in 'shards' sub-queues, one
+ * per online CPU if 'shards' is 0, each with its own lock.
+ *
+ * send_chan pushes to the sub-queue of the core it runs on, and recv_chan pops from
+ * it first, stealing from the other sub-queues when it is empty. Neither takes the
+ * channel lock unless a thread is waiting on the other side, so throughput scales
+ * with the number of cores. In exchange, values are only FIFO within a sub-queue:
+ * two values sent from different cores may be received in any order. The channel
+ * works in select_chan like any other, but has no readiness descriptors.
+ *
+ * Returns:
+ * The identifier of the created channel, or -1 on failure.
+ */
+extern int make_chan_sharded(size_t len, size_t shards);
+
+/*
+ * Function: make_chan_typed
+ * -------------------------
+ * This function creates a new channel whose buffer holds 'len' elements of
+ * 'elem_size' bytes, packed, instead of tagged any_t values: a channel of
+ * pointers holds two elements where an any_t channel holds one.
+ *
+ * Every operation on the channel passes an any_t whose value.pointer_val points
+ * to the element to send, or to where the received element is copied. The
+ * element is copied while the operation completes, so the pointer only has to
+ * stay valid until then. LC_DEFINE_CHAN generates typed functions that do so.
+ *
+ * Returns:
+ * The identifier of the created channel, or -1 on failure.
+ */
+extern int make_chan_typed(size_t len, size_t elem_size);
+
+/*
+ * Macro: LC_DEFINE_CHAN
+ * ---------------------
+ * Defines a channel type 'name_t' carrying values of type T, stored in the buffer
+ * as sizeof(T) bytes, and its static inline functions:
+ *
+ *      name_t name_make(size_t len): creates a channel (its 'cd' is -1 on failure).
+ *      int name_send(name_t ch, T val): sends a value, like send_chan.
+ *      int name_recv(name_t ch, T *val): receives a value, like recv_chan.
+ *      int name_try_send(name_t ch, T val): sends without blocking.
+ *      int name_try_recv(name_t ch, T *val): receives without blocking.
+ *      void name_select_send(select_set_t *op, any_t *box, name_t ch, T *val)
+ *      void name_select_recv(select_set_t *op, any_t *box, name_t ch, T *val):
+ *          fill an entry of a select_chan set. 'box' is the any_t the entry points
+ *          to, and 'box' and 'val' must live until select_chan returns.
+ *      int name_close(name_t ch): closes the channel, like close_chan.
+ *
+ * Example:
+ *
+ *     LC_DEFINE_CHAN(int_chan, int64_t)
+ *
+ *     int_chan_t ch = int_chan_make(64);
+ *     int_chan_send(ch, 42);
+ */
+#define LC_DEFINE_CHAN(name, T)                                                       \
+    typedef struct { int cd; } name##_t;                                              \
+    static inline name##_t name##_make(size_t len) {                                  \
+        name##_t ch;                                                                  \
+        ch.cd = make_chan_typed(len, sizeof(T));                                      \
+        return ch;                                                                    \
+    }                                                                                 \
+    static inline void name##_box(any_t *box, T *val) {                               \
+        box->type = VAR_POINTER;                                                      \
+        box->value.pointer_val = val;                                                 \
+    }                                                                                 \
+    static inline int name##_send(name##_t ch, T val) {                               \
+        any_t box;                                                                    \
+        name##_box(&box, &val);                                                       \
+        return send_chan(ch.cd, &box);                                                \
+    }                                                                                 \
+    static inline int name##_recv(name##_t ch, T *val) {                              \
+        any_t box;                                                                    \
+        name##_box(&box, val);                                                        \
+        return recv_chan(ch.cd, &box);                                                \
+    }                                                                                 \
+    static inline int name##_try_send(name##_t ch, T val) {                           \
+        any_t box;                                                                    \
+        name##_box(&box, &val);                                                       \
+        return send_chan_bctrl(ch.cd, &box, SELECT_NONBLOCK);                         \
+    }                                                                                 \
+    static inline int name##_try_recv(name##_t ch, T *val) {                          \
+        any_t box;                                                                    \
+        name##_box(&box, val);                                                        \
+        return recv_chan_bctrl(ch.cd, &box, SELECT_NONBLOCK);                         \
+    }                                                                                 \
+    static inline void name##_select_send(select_set_t *op, any_t *box, name##_t ch, T *val) { \
+        name##_box(box, val);                                                         \
+        op->cd = ch.cd;                                                               \
+        op->op_type = OP_SEND;                                                        \
+        op->send = box;                                                               \
+        op->recv = NULL;                                                              \
+        op->key = 0;                                                                  \
+    }                                                                                 \
+    static inline void name##_select_recv(select_set_t *op, any_t *box, name##_t ch, T *val) { \
+        name##_box(box, val);                                                         \
+        op->cd = ch.cd;                                                               \
+        op->op_type = OP_RECV;                                                        \
+        op->send = NULL;                                                              \
+        op->recv = box;                                                               \
+        op->key = 0;                                                                  \
+    }                                                                                 \
+    static inline int name##_close(name##_t ch) {                                     \
+        return close_chan(ch.cd);                                                     \
+    }
+
 
 /*
  * Function: close_chan
@@ -178,7 +868,7 @@ extern int close_chan(int cd);
  * properly initialized.
  *
  * If the channel is NULL or hasn't been properly initialized,
- * the function returns a zero.
+ * the function returns a zero. Like len, it does not lock the channel.
  *
  * Parameters:
  * chan: The channel whose capacity we want to find out.
@@ -199,6 +889,10 @@ extern int cap(int cd);
  * If the channel is NULL or hasn't been properly initialized,
  * the function returns a zero.
  *
+ * The length is read atomically without locking the channel, so
+ * polling it does not slow down senders and receivers. It is a
+ * snapshot that concurrent operations may change right away.
+ *
  * Parameters:
  * chan: The channel whose length we want to find out.
  *
@@ -206,4 +900,321 @@ extern int cap(int cd);
  * The length of the channel, or zero if the channel is not properly initialized.
  */
 extern int len(int cd);
+
+/*
+ * Function: resize_chan
+ * --------------------
+ * This function changes the capacity of a channel while it is in use.
+ *
+ * The buffered values are kept in order. If the capacity grows, parked
+ * senders are woken up, one per new free slot. A channel cannot shrink
+ * below the number of values it holds. Only channels created with make_chan
+ * can be resized.
+ *
+ * Parameters:
+ * cd: The channel descriptor.
+ * new_cap: The new capacity, at least 1.
+ *
+ * Returns:
+ * 0 on success, -1 otherwise.
+ */
+extern int resize_chan(int cd, size_t new_cap);
+
+/*
+ * Function: chan_fd
+ * --------------------
+ * This function returns a readiness file descriptor for the channel.
+ *
+ * The descriptor is an eventfd that is readable while the given operation
+ * could complete without blocking: while the channel holds data for OP_RECV,
+ * and while it has free space for OP_SEND. It is meant to be registered in
+ * an epoll (or poll/select) loop so a channel can be consumed without a
+ * dedicated thread blocked in recv_chan. The library only writes to it on
+ * empty<->non-empty and full<->non-full transitions; the caller must never
+ * read from it. Call it once per operation type to watch both directions.
+ *
+ * Parameters:
+ * cd: The channel descriptor.
+ * op_type: OP_RECV or OP_SEND.
+ *
+ * Returns:
+ * The readiness file descriptor, owned by the channel and closed by close_chan,
+ * or -1 if the channel does not exist or the descriptor could not be created.
+ */
+extern int chan_fd(int cd, int op_type);
+
+/*
+ * Type: selgroup_t, selgroup_event_t
+ * ----------------------------------
+ * A select group is a persistent set of channel operations, in the spirit of epoll:
+ * the operations are registered once, and each channel pushes its registrations to
+ * the ready list of the group when the operation becomes possible. Waiting on the
+ * group costs O(ready operations), not O(registered operations) as select_chan.
+ *
+ * An event names a registered operation that can complete ('closed' is 0), or one
+ * whose channel was closed ('closed' is 1; the registration is then dropped).
+ * Readiness is level-triggered: an operation is reported by every wait while it can
+ * complete. Another thread may still take the value or the slot first, so perform
+ * the operation with SELECT_NONBLOCK. Semaphores, wait groups, barriers and sharded
+ * channels cannot be registered.
+ */
+typedef struct selgroup selgroup_t;
+
+typedef struct {
+    int cd;
+    int op_type;
+    int closed;
+} selgroup_event_t;
+
+/*
+ * Function: selgroup_create / selgroup_free
+ * -----------------------------------------
+ * selgroup_create creates an empty select group, or returns NULL if memory runs out.
+ * selgroup_free withdraws all its registrations and frees it; no thread may be
+ * waiting on it.
+ */
+extern selgroup_t *selgroup_create(void);
+extern void selgroup_free(selgroup_t *g);
+
+/*
+ * Function: selgroup_add / selgroup_del
+ * -------------------------------------
+ * These functions register an operation (OP_RECV or OP_SEND) on a channel in a
+ * select group, and withdraw it.
+ *
+ * Returns:
+ * 0 on success, -1 if the channel or the registration does not exist, or if the
+ * channel cannot be registered.
+ */
+extern int selgroup_add(selgroup_t *g, int cd, int op_type);
+extern int selgroup_del(selgroup_t *g, int cd, int op_type);
+
+/*
+ * Function: selgroup_wait
+ * -----------------------
+ * This function waits until registered operations of a select group can complete.
+ *
+ * Parameters:
+ * g: The select group.
+ * events: Where to store the events.
+ * max: The maximum number of events to store.
+ * timeout: The maximum time to wait in milliseconds; -1 waits forever, 0 returns at once.
+ *
+ * Returns:
+ * The number of events stored, 0 on timeout, or -1 on invalid arguments.
+ */
+extern int selgroup_wait(selgroup_t *g, selgroup_event_t *events, size_t max, int timeout);
+
+/*
+ * Function: init_task_runtime
+ * ---------------------------
+ * This function starts the task runtime, a pool of worker threads that run
+ * lightweight tasks (green threads) started with go_task.
+ *
+ * Each task runs on a small mmap'd stack. Workers pop tasks from their own run
+ * queue and steal from the others when it is empty. When a task blocks on a
+ * channel (send_chan, recv_chan, select_chan...), it is parked and its worker
+ * switches to the next runnable task in user space instead of blocking the
+ * whole thread, so many thousands of tasks can wait on channels at once.
+ *
+ * Tasks should not call other blocking functions (sleep, blocking I/O,
+ * select_chan_fds): those block the worker and every task queued on it.
+ *
+ * Parameters:
+ * n: The number of worker threads, or 0 for one per online CPU.
+ *
+ * Returns:
+ * 0 on success, -1 if the runtime is already running or could not be started.
+ */
+extern int init_task_runtime(int n);
+
+/*
+ * Function: go_task
+ * -----------------
+ * This function starts a new task that runs fn(arg) on the task runtime. It is
+ * the lightweight counterpart of creating a detached thread for every goroutine.
+ *
+ * Parameters:
+ * fn: The function to run, with the same signature as a thread start routine.
+ *     Its return value is ignored.
+ * arg: The argument passed to fn.
+ *
+ * Returns:
+ * 0 on success, -1 if the runtime is not running or the task could not be allocated.
+ */
+extern int go_task(void *(*fn)(void *), void *arg);
+
+/*
+ * Function: yield_task
+ * --------------------
+ * This function lets the worker run other runnable tasks before the calling task
+ * continues. It does nothing when called outside a task.
+ */
+extern void yield_task(void);
+
+/*
+ * Function: wait_tasks
+ * --------------------
+ * This function blocks the calling thread until every task started with go_task
+ * has returned. It must be called from a thread, not from a task.
+ */
+extern void wait_tasks(void);
+
+/*
+ * Type: pool_t
+ * ------------
+ * A fixed pool of worker threads fed by a lock-free job queue. It avoids paying
+ * pthread_create and pthread_detach for every short job.
+ */
+typedef struct pool pool_t;
+
+/*
+ * Function: pool_create
+ * ---------------------
+ * This function creates a pool of worker threads.
+ *
+ * Parameters:
+ * nthreads: The number of workers, or 0 for one per online CPU.
+ *
+ * Returns:
+ * The new pool, or NULL on failure.
+ */
+extern pool_t *pool_create(int nthreads);
+
+/*
+ * Function: pool_create_pinned
+ * ----------------------------
+ * Same as pool_create, but worker i is pinned to the i-th CPU in the affinity
+ * mask of the process (see sched_getaffinity), modulo the number of CPUs in it.
+ */
+extern pool_t *pool_create_pinned(int nthreads);
+
+/*
+ * Function: pool_submit
+ * ---------------------
+ * This function queues fn(arg) to run on one of the workers of the pool. The
+ * return value of fn is ignored. It blocks while the job queue is full.
+ *
+ * Returns:
+ * 0 on success, -1 on invalid arguments.
+ */
+extern int pool_submit(pool_t *pool, void *(*fn)(void *), void *arg);
+
+/*
+ * Function: pool_submit_chan
+ * --------------------------
+ * Same as pool_submit, but the value returned by fn is sent on channel 'cd' as
+ * a VAR_POINTER once the job finishes, so results can be collected with
+ * recv_chan or select_chan.
+ */
+extern int pool_submit_chan(pool_t *pool, void *(*fn)(void *), void *arg, int cd);
+
+/*
+ * Function: pool_wait
+ * -------------------
+ * This function blocks until every job submitted so far has finished.
+ */
+extern void pool_wait(pool_t *pool);
+
+/*
+ * Function: pool_destroy
+ * ----------------------
+ * This function lets the workers finish the queued jobs, stops them and frees
+ * the pool.
+ */
+extern void pool_destroy(pool_t *pool);
+
+/*
+ * Type: shm_chan_t
+ * ----------------
+ * A channel placed in a POSIX shared memory segment, so that processes on the same
+ * host can exchange fixed-size elements at memory speed. The ring and the wait
+ * state live in the segment: processes park on process-shared futexes, and the
+ * segment lock is a robust mutex, so a peer that crashes while holding it does not
+ * wedge the others. Uncontended operations make no system call.
+ *
+ * Shared memory channels have their own API and descriptors space: they cannot be
+ * used with select_chan.
+ */
+typedef struct shm_chan shm_chan_t;
+
+/*
+ * Function: make_chan_shm
+ * -----------------------
+ * This function creates a shared memory channel.
+ *
+ * Parameters:
+ * name: The name of the shared memory object, as for shm_open (e.g. "/jobs").
+ * len: The capacity of the channel, in elements.
+ * elem_size: The size of an element, in bytes.
+ *
+ * Returns:
+ * A handle to the channel, or NULL with errno set (EEXIST if the name is taken).
+ */
+extern shm_chan_t *make_chan_shm(const char *name, size_t len, size_t elem_size);
+
+/*
+ * Function: open_chan_shm
+ * -----------------------
+ * This function opens a shared memory channel created by make_chan_shm, usually
+ * in another process.
+ *
+ * Returns:
+ * A handle to the channel, or NULL with errno set.
+ */
+extern shm_chan_t *open_chan_shm(const char *name);
+
+/*
+ * Function: close_chan_shm
+ * ------------------------
+ * This function unmaps a shared memory channel from the calling process and frees
+ * its handle.
+ */
+extern void close_chan_shm(shm_chan_t *ch);
+
+/*
+ * Function: unlink_chan_shm
+ * -------------------------
+ * This function removes the name of a shared memory channel. The segment is freed
+ * once every process closed it.
+ *
+ * Returns:
+ * 0 on success, -1 with errno set.
+ */
+extern int unlink_chan_shm(const char *name);
+
+/*
+ * Function: send_chan_shm
+ * -----------------------
+ * This function copies one element of elem_size bytes into a shared memory channel.
+ * If should_block is OP_BLOCK, it waits for free space.
+ *
+ * Returns:
+ * 0 on success, -1 with errno set (EAGAIN if the channel is full and should_block
+ * is OP_NONBLOCK).
+ */
+extern int send_chan_shm(shm_chan_t *ch, const void *elem, int should_block);
+
+/*
+ * Function: recv_chan_shm
+ * -----------------------
+ * This function copies one element out of a shared memory channel. If should_block
+ * is OP_BLOCK, it waits for data.
+ *
+ * Returns:
+ * 0 on success, -1 with errno set (EAGAIN if the channel is empty and should_block
+ * is OP_NONBLOCK).
+ */
+extern int recv_chan_shm(shm_chan_t *ch, void *elem, int should_block);
+
+/*
+ * Function: len_chan_shm
+ * ----------------------
+ * This function returns the number of elements buffered in a shared memory channel.
+ */
+extern size_t len_chan_shm(shm_chan_t *ch);
+
+#ifdef __cplusplus
+}
+#endif
 #endif
\ No newline at end of file
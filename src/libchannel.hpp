@@ -0,0 +1,564 @@
+/*
+ * File: libchannel.hpp
+ * ----------------------------
+ * Header-only C++17 wrapper around libchannel.
+ *
+ * 'lc::chan<T>' is a typed, move-only handle to a channel that carries values of
+ * type T. Trivially copyable types that fit in the any_t value union (integers,
+ * floats, pointers, small structs) are stored in place in the channel buffer and
+ * never allocate. Other types are moved into a heap box that travels as a
+ * VAR_POINTER and is moved out and freed by the receiver.
+ *
+ * 'lc::select' and 'lc::try_select' wrap select_chan over a list of cases built
+ * with 'lc::recv_case' and 'lc::send_case'. The select set lives in a stack array,
+ * so selecting does not allocate either.
+ *
+ * With C++20 coroutines, 'co_await ch.async_recv()', 'co_await ch.async_send(v)'
+ * and 'co_await lc::async_select(...)' suspend the coroutine instead of blocking
+ * the thread. The pending operation is registered on the channels' wait queues
+ * (see select_chan_async) and the coroutine is resumed by the thread that makes
+ * the channel ready, or posted to a user-provided executor: any object with a
+ * 'post(std::coroutine_handle<>)' member.
+ *
+ * Example:
+ *
+ *     lc::chan<int> numbers(16);
+ *     lc::chan<std::string> names(4);
+ *
+ *     numbers.send(42);
+ *     lc::select(
+ *         lc::recv_case(numbers, [](int n) { ... }),
+ *         lc::recv_case(names, [](std::string s) { ... }));
+ *
+ * Note:
+ * init_libchannel() must still be called before creating channels.
+ */
+#ifndef _LIBCHANNEL_HPP
+#define _LIBCHANNEL_HPP 1
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <tuple>
+#define LC_HAS_COROUTINES 1
+#endif
+
+#include "libchannel.h"
+
+namespace lc {
+
+#ifdef LC_HAS_COROUTINES
+struct inline_executor;
+
+template <typename T, typename Executor>
+class recv_awaiter;
+
+template <typename T, typename Executor>
+class send_awaiter;
+#endif
+
+namespace detail {
+
+using any_value_t = decltype(any_t::value);
+
+/*
+ * is_inline_v<T> tells whether T is stored in place in the any_t value union.
+ */
+template <typename T>
+inline constexpr bool is_inline_v = std::is_trivially_copyable_v<T>
+                                    && sizeof(T) <= sizeof(any_value_t)
+                                    && alignof(T) <= alignof(any_value_t);
+
+/*
+ * type_tag<T>() returns the any_t type tag used for T, so that values sent from
+ * C++ can still be decoded by C code reading the same channel.
+ */
+template <typename T>
+constexpr int type_tag() {
+    if constexpr (!is_inline_v<T> || std::is_pointer_v<T>)
+        return VAR_POINTER;
+    else if constexpr (std::is_same_v<T, float>)
+        return VAR_FLOAT;
+    else if constexpr (std::is_same_v<T, double>)
+        return VAR_DOUBLE;
+    else if constexpr (sizeof(T) == 1)
+        return VAR_INT8;
+    else if constexpr (sizeof(T) == 2)
+        return VAR_INT16;
+    else if constexpr (sizeof(T) <= 4)
+        return VAR_INT32;
+    else
+        return VAR_INT64;
+}
+
+/*
+ * emplace_any constructs a T from 'args' directly into the any_t slot, or into a
+ * heap box referenced by the slot for types that are not stored in place.
+ */
+template <typename T, typename... Args>
+inline void emplace_any(any_t &slot, Args &&...args) {
+    slot.type = type_tag<T>();
+    if constexpr (is_inline_v<T>) {
+        slot.value.int64_val = 0;
+        ::new (static_cast<void *>(&slot.value)) T(std::forward<Args>(args)...);
+    } else {
+        slot.value.pointer_val = new T(std::forward<Args>(args)...);
+    }
+}
+
+/*
+ * take_any moves the T out of an any_t slot filled by emplace_any, freeing its box.
+ */
+template <typename T>
+inline T take_any(any_t &slot) {
+    if constexpr (is_inline_v<T>) {
+        alignas(T) unsigned char bytes[sizeof(T)];
+        std::memcpy(bytes, &slot.value, sizeof(T));
+        return *std::launder(reinterpret_cast<T *>(bytes));
+    } else {
+        T *box = static_cast<T *>(slot.value.pointer_val);
+        T value(std::move(*box));
+        delete box;
+        return value;
+    }
+}
+
+/*
+ * drop_any destroys the T held by an any_t slot without returning it.
+ */
+template <typename T>
+inline void drop_any(any_t &slot) {
+    if constexpr (!is_inline_v<T>)
+        delete static_cast<T *>(slot.value.pointer_val);
+}
+
+} // namespace detail
+
+/*
+ * Class: chan<T>
+ * --------------
+ * Owning, move-only handle to a channel of T. The channel is closed when the
+ * handle is destroyed; values still buffered at that point are destroyed.
+ *
+ * Iterating over a channel with range-for drains the values currently buffered,
+ * without blocking.
+ */
+template <typename T>
+class chan {
+public:
+    using value_type = T;
+
+    explicit chan(size_t capacity = 1) : cd_(make_chan(capacity)) {}
+
+    chan(const chan &) = delete;
+    chan &operator=(const chan &) = delete;
+
+    chan(chan &&other) noexcept : cd_(std::exchange(other.cd_, 0)) {}
+
+    chan &operator=(chan &&other) noexcept {
+        if (this != &other) {
+            close();
+            cd_ = std::exchange(other.cd_, 0);
+        }
+        return *this;
+    }
+
+    ~chan() { close(); }
+
+    // Channel descriptor, for use with the C API.
+    int cd() const noexcept { return cd_; }
+
+    explicit operator bool() const noexcept { return cd_ > 0; }
+
+    size_t size() const { return static_cast<size_t>(len(cd_)); }
+
+    size_t capacity() const { return static_cast<size_t>(cap(cd_)); }
+
+    // Blocking send. Returns false if the channel is closed.
+    bool send(const T &value) { return emplace_block(OP_BLOCK, value); }
+    bool send(T &&value) { return emplace_block(OP_BLOCK, std::move(value)); }
+
+    // Blocking send of a T constructed in place from 'args'.
+    template <typename... Args>
+    bool emplace(Args &&...args) { return emplace_block(OP_BLOCK, std::forward<Args>(args)...); }
+
+    // Non-blocking send. On failure 'value' is left untouched.
+    bool try_send(T &&value) {
+        any_t slot;
+        detail::emplace_any<T>(slot, std::move(value));
+        if (send_chan_bctrl(cd_, &slot, OP_NONBLOCK) == cd_)
+            return true;
+        value = detail::take_any<T>(slot);
+        return false;
+    }
+
+    bool try_send(const T &value) { return emplace_block(OP_NONBLOCK, value); }
+
+    // Blocking receive. Returns std::nullopt if the channel is closed.
+    std::optional<T> recv() { return recv_block(OP_BLOCK); }
+
+    // Non-blocking receive. Returns std::nullopt if the channel is empty or closed.
+    std::optional<T> try_recv() { return recv_block(OP_NONBLOCK); }
+
+    // Destroy the buffered values and close the channel. Returns false if it is
+    // still in use by a blocked thread, in which case it is left open.
+    bool close() {
+        any_t slot;
+        if (cd_ <= 0)
+            return true;
+        while (recv_chan_bctrl(cd_, &slot, OP_NONBLOCK) == cd_)
+            detail::drop_any<T>(slot);
+        if (close_chan(cd_) != 0)
+            return false;
+        cd_ = 0;
+        return true;
+    }
+
+    class iterator {
+    public:
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using reference = T &;
+        using pointer = T *;
+        using iterator_category = std::input_iterator_tag;
+
+        iterator() = default;
+        explicit iterator(chan *ch) : ch_(ch) { ++*this; }
+
+        T &operator*() { return *value_; }
+        T *operator->() { return &*value_; }
+
+        iterator &operator++() {
+            if (ch_ && !(value_ = ch_->try_recv()))
+                ch_ = nullptr;
+            return *this;
+        }
+
+        bool operator==(const iterator &other) const { return ch_ == other.ch_; }
+        bool operator!=(const iterator &other) const { return ch_ != other.ch_; }
+
+    private:
+        chan *ch_ = nullptr;
+        std::optional<T> value_;
+    };
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+
+#ifdef LC_HAS_COROUTINES
+    // Awaitable receive: 'co_await ch.async_recv()' yields std::optional<T>.
+    template <typename Executor = inline_executor>
+    recv_awaiter<T, Executor> async_recv(Executor ex = Executor());
+
+    // Awaitable send: 'co_await ch.async_send(v)' yields false if the channel is closed.
+    template <typename Executor = inline_executor>
+    send_awaiter<T, Executor> async_send(T value, Executor ex = Executor());
+#endif
+
+private:
+    template <typename... Args>
+    bool emplace_block(int should_block, Args &&...args) {
+        any_t slot;
+        detail::emplace_any<T>(slot, std::forward<Args>(args)...);
+        if (send_chan_bctrl(cd_, &slot, should_block) == cd_)
+            return true;
+        detail::drop_any<T>(slot);
+        return false;
+    }
+
+    std::optional<T> recv_block(int should_block) {
+        any_t slot;
+        if (recv_chan_bctrl(cd_, &slot, should_block) != cd_)
+            return std::nullopt;
+        return std::optional<T>(detail::take_any<T>(slot));
+    }
+
+    int cd_;
+};
+
+/*
+ * Select cases
+ * ------------
+ * recv_case(ch, f) calls f(T) with the received value if the case is taken.
+ * send_case(ch, value, f) moves 'value' into the channel and calls f() if the case
+ * is taken; otherwise 'value' is left with its original contents.
+ */
+template <typename T, typename F>
+struct recv_case_t {
+    chan<T> &ch;
+    F        fn;
+    any_t    slot;
+
+    void prepare(select_set_t &op) { op = select_set_t{ch.cd(), OP_RECV, nullptr, &slot}; }
+
+    void finish(bool taken) {
+        if (taken)
+            fn(detail::take_any<T>(slot));
+    }
+};
+
+template <typename T, typename F>
+struct send_case_t {
+    chan<T> &ch;
+    T       &value;
+    F        fn;
+    any_t    slot;
+
+    void prepare(select_set_t &op) {
+        detail::emplace_any<T>(slot, std::move(value));
+        op = select_set_t{ch.cd(), OP_SEND, &slot, nullptr};
+    }
+
+    void finish(bool taken) {
+        if (taken)
+            fn();
+        else
+            value = detail::take_any<T>(slot);
+    }
+};
+
+template <typename T, typename F>
+recv_case_t<T, F> recv_case(chan<T> &ch, F fn) { return {ch, std::move(fn), {}}; }
+
+template <typename T, typename F>
+send_case_t<T, F> send_case(chan<T> &ch, T &value, F fn) { return {ch, value, std::move(fn), {}}; }
+
+namespace detail {
+
+template <typename... Cases>
+int select_cases(int should_block, Cases &...cases) {
+    std::array<select_set_t, sizeof...(Cases)> set;
+    const int cds[] = {cases.ch.cd()...};
+    size_t i = 0;
+    int taken = -1;
+    int cd;
+
+    (cases.prepare(set[i++]), ...);
+    cd = select_chan(set.data(), set.size(), should_block);
+
+    // select_chan reorders the set, so find the case by its channel
+    for (i = 0; cd > 0 && i < sizeof...(Cases); i++) {
+        if (cds[i] == cd) {
+            taken = static_cast<int>(i);
+            break;
+        }
+    }
+    i = 0;
+    (cases.finish(static_cast<int>(i++) == taken), ...);
+    return taken;
+}
+
+} // namespace detail
+
+/*
+ * Function: select
+ * ----------------
+ * Blocks until one of the cases can proceed, performs it and runs its handler.
+ * A channel should appear in at most one case.
+ *
+ * Returns:
+ * The index of the case taken, or -1 if a channel of the set is closed.
+ */
+template <typename... Cases>
+int select(Cases &&...cases) {
+    return detail::select_cases(SELECT_BLOCK, cases...);
+}
+
+/*
+ * Function: try_select
+ * --------------------
+ * Same as select, but returns -1 immediately if no case can proceed.
+ */
+template <typename... Cases>
+int try_select(Cases &&...cases) {
+    return detail::select_cases(SELECT_NONBLOCK, cases...);
+}
+
+#ifdef LC_HAS_COROUTINES
+/*
+ * Struct: inline_executor
+ * -----------------------
+ * Resumes a coroutine directly on the thread that made its channel ready, once
+ * that thread released its channel locks.
+ */
+struct inline_executor {
+    void post(std::coroutine_handle<> handle) const { handle.resume(); }
+};
+
+namespace detail {
+
+/*
+ * Struct: async_base
+ * ------------------
+ * Common part of the awaitables: the select set, and the chan_async_t registered
+ * on its channels. Once the operation is completed by the waker, the coroutine is
+ * posted to the executor.
+ */
+template <size_t N, typename Executor>
+struct async_base {
+    std::array<select_set_t, N> set;
+    chan_async_t            op{};
+    Executor                ex;
+    std::coroutine_handle<> handle;
+    int                     result = 0;
+
+    explicit async_base(Executor executor) : ex(std::move(executor)) {}
+
+    async_base(const async_base &) = delete;
+    async_base &operator=(const async_base &) = delete;
+
+    // Returns true if the coroutine stays suspended. The awaitable must not be
+    // touched after a pending select_chan_async: it may already be resumed.
+    bool start(std::coroutine_handle<> h) {
+        int ret;
+        handle = h;
+        op.ready = &on_ready;
+        op.data = this;
+        if ((ret = select_chan_async(set.data(), N, &op)) == 0)
+            return true;
+        result = ret;
+        return false;
+    }
+
+    static void on_ready(chan_async_t *op) {
+        auto *self = static_cast<async_base *>(op->data);
+        int ret = select_chan_async_resume(self->set.data(), N, op);
+        if (ret == 0)
+            return;
+        self->result = ret;
+        self->ex.post(self->handle);
+    }
+};
+
+} // namespace detail
+
+template <typename T, typename Executor>
+class recv_awaiter : detail::async_base<1, Executor> {
+public:
+    recv_awaiter(chan<T> &ch, Executor ex) : detail::async_base<1, Executor>(std::move(ex)), ch_(ch) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        this->set[0] = select_set_t{ch_.cd(), OP_RECV, nullptr, &slot_};
+        return this->start(h);
+    }
+
+    std::optional<T> await_resume() {
+        if (this->result != ch_.cd())
+            return std::nullopt;
+        return std::optional<T>(detail::take_any<T>(slot_));
+    }
+
+private:
+    chan<T> &ch_;
+    any_t    slot_;
+};
+
+template <typename T, typename Executor>
+class send_awaiter : detail::async_base<1, Executor> {
+public:
+    send_awaiter(chan<T> &ch, T value, Executor ex)
+        : detail::async_base<1, Executor>(std::move(ex)), ch_(ch), value_(std::move(value)) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        detail::emplace_any<T>(slot_, std::move(value_));
+        this->set[0] = select_set_t{ch_.cd(), OP_SEND, &slot_, nullptr};
+        return this->start(h);
+    }
+
+    bool await_resume() {
+        if (this->result == ch_.cd())
+            return true;
+        detail::drop_any<T>(slot_);
+        return false;
+    }
+
+private:
+    chan<T> &ch_;
+    T        value_;
+    any_t    slot_;
+};
+
+template <typename Executor, typename... Cases>
+class select_awaiter : detail::async_base<sizeof...(Cases), Executor> {
+public:
+    select_awaiter(Executor ex, Cases... cases)
+        : detail::async_base<sizeof...(Cases), Executor>(std::move(ex)), cases_(std::move(cases)...) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+        std::apply([this](auto &...cases) {
+            size_t i = 0;
+            (cases.prepare(this->set[i++]), ...);
+        }, cases_);
+        return this->start(h);
+    }
+
+    // Runs the handler of the case taken and returns its index, or -1 if a
+    // channel of the set is closed.
+    int await_resume() {
+        return std::apply([this](auto &...cases) {
+            const int cds[] = {cases.ch.cd()...};
+            int taken = -1;
+            size_t i;
+            for (i = 0; this->result > 0 && i < sizeof...(Cases); i++) {
+                if (cds[i] == this->result) {
+                    taken = static_cast<int>(i);
+                    break;
+                }
+            }
+            i = 0;
+            (cases.finish(static_cast<int>(i++) == taken), ...);
+            return taken;
+        }, cases_);
+    }
+
+private:
+    std::tuple<Cases...> cases_;
+};
+
+template <typename T>
+template <typename Executor>
+recv_awaiter<T, Executor> chan<T>::async_recv(Executor ex) {
+    return recv_awaiter<T, Executor>(*this, std::move(ex));
+}
+
+template <typename T>
+template <typename Executor>
+send_awaiter<T, Executor> chan<T>::async_send(T value, Executor ex) {
+    return send_awaiter<T, Executor>(*this, std::move(value), std::move(ex));
+}
+
+/*
+ * Function: async_select
+ * ----------------------
+ * Awaitable counterpart of select: 'co_await lc::async_select(cases...)' suspends
+ * the coroutine until one of the cases can proceed, runs its handler and yields
+ * its index. async_select_on does the same but resumes on 'ex'.
+ */
+template <typename... Cases>
+select_awaiter<inline_executor, Cases...> async_select(Cases... cases) {
+    return select_awaiter<inline_executor, Cases...>(inline_executor(), std::move(cases)...);
+}
+
+template <typename Executor, typename... Cases>
+select_awaiter<Executor, Cases...> async_select_on(Executor ex, Cases... cases) {
+    return select_awaiter<Executor, Cases...>(std::move(ex), std::move(cases)...);
+}
+#endif
+
+} // namespace lc
+
+#endif
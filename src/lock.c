@@ -6,6 +6,7 @@
 #include "chan.h"
 #include "cvpool.h"
 #include "chpool.h"
+#include "alloc.h"
 
 /*
  * Function: compare_int
@@ -34,7 +35,8 @@ static int compare_int(const void * a, const void * b) {
  * -----------------
  * This function acquires locks for all channels in the provided set in ascending order of their descriptors.
  * This is done to prevent deadlocks that could occur if multiple threads attempt to lock channels in different 
- * orders simultaneously. Before locking, it creates an array 'lockorder' to store channel descriptors 
+ * orders simultaneously. The order holds whatever the kind of each channel lock (mutex,
+ * ticket or MCS), since every kind blocks only on its current holder. Before locking, it creates an array 'lockorder' to store channel descriptors 
  * (cd) and sorts them using 'qsort'. Then it locks all the channels based on this order. 
  * It returns a pointer to the 'lockorder' array.
  * 
@@ -47,7 +49,7 @@ static int compare_int(const void * a, const void * b) {
  */
 int *lockall(select_set_t *set, size_t n) {
     int i;
-    int *lockorder = calloc(n, sizeof(int));
+    int *lockorder = lc_alloc(n * sizeof(int));
     chan_t *chan;
     if (!lockorder)
         return NULL;
@@ -60,7 +62,7 @@ int *lockall(select_set_t *set, size_t n) {
     for (i = 0; i < n; i++) {
         chan = get_channel_from_table(lockorder[i]);
         if (chan)
-            pthread_mutex_lock(&(chan->mutex));
+            chlock_lock(&(chan->lock));
     }
     return lockorder;
 }
@@ -85,8 +87,8 @@ void unlockall(int **lockorder, size_t n) {
     for (i = 0; i < n; i++) {
         chan = get_channel_from_table((*lockorder)[i]);
         if (chan)
-            pthread_mutex_unlock(&(chan->mutex));
+            chlock_unlock(&(chan->lock));
     }
-    free(*lockorder);
+    lc_free(*lockorder, n * sizeof(int));
     *lockorder = NULL;
 }
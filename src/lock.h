@@ -8,7 +8,8 @@
  * -----------------
  * This function acquires locks for all channels in the provided set in ascending order of their descriptors.
  * This is done to prevent deadlocks that could occur if multiple threads attempt to lock channels in different 
- * orders simultaneously. Before locking, it creates an array 'lockorder' to store channel descriptors 
+ * orders simultaneously. The order holds whatever the kind of each channel lock (mutex,
+ * ticket or MCS), since every kind blocks only on its current holder. Before locking, it creates an array 'lockorder' to store channel descriptors 
  * (cd) and sorts them using 'qsort'. Then it locks all the channels based on this order. 
  * It returns a pointer to the 'lockorder' array.
  * 
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "libchannel.h"
+#include "atomic.h"
+
+/*
+ * Constant: POOL_QUEUE_SIZE
+ * -------------------------
+ * Number of cells of the job queue of a pool. Must be a power of two.
+ */
+#define POOL_QUEUE_SIZE 1024
+
+/*
+ * `pool_job_t` is a cell of the job queue. 'seq' tells producers and consumers whose
+ * turn it is: a producer may fill the cell at position p when seq == p, a consumer may
+ * empty it when seq == p + 1.
+ */
+typedef struct {
+    atomic_size_t seq;
+    void *(*fn)(void *);
+    void *arg;
+    int   cd;                  // Channel the result is sent on, or 0
+} pool_job_t;
+
+struct pool {
+    pool_job_t    jobs[POOL_QUEUE_SIZE];
+    atomic_size_t head;        // Next position to dequeue
+    atomic_size_t tail;        // Next position to enqueue
+    sem_t         items;       // Jobs in the queue, workers sleep on it
+    sem_t         slots;       // Free cells in the queue, submitters sleep on it
+
+    atomic_int      pending;   // Jobs submitted and not finished yet
+    pthread_mutex_t mutex;
+    pthread_cond_t  idle;      // Signaled when pending drops to 0
+
+    int        nthreads;
+    pthread_t *threads;
+};
+
+/*
+ * Function: job_push
+ * ------------------
+ * Enqueues a job in the lock-free queue of the pool. The caller must own a slot
+ * (see 'slots'), so a free cell is always found, at worst after a short spin while
+ * a consumer finishes emptying it.
+ */
+static void job_push(pool_t *pool, void *(*fn)(void *), void *arg, int cd) {
+    pool_job_t *job;
+    size_t pos = atomic_load_explicit(&(pool->tail), memory_order_relaxed);
+    size_t seq;
+
+    for (;;) {
+        job = &(pool->jobs[pos & (POOL_QUEUE_SIZE - 1)]);
+        seq = atomic_load_explicit(&(job->seq), memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&(pool->tail), &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if ((intptr_t)(seq - pos) < 0) {
+            // The cell is still being emptied
+            sched_yield();
+            pos = atomic_load_explicit(&(pool->tail), memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&(pool->tail), memory_order_relaxed);
+        }
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->cd = cd;
+    atomic_store_explicit(&(job->seq), pos + 1, memory_order_release);
+}
+
+/*
+ * Function: job_pop
+ * -----------------
+ * Dequeues a job from the lock-free queue of the pool. The caller must own an item
+ * (see 'items'), so a job is always found, at worst after a short spin while a
+ * producer finishes filling its cell.
+ */
+static void job_pop(pool_t *pool, pool_job_t *out) {
+    pool_job_t *job;
+    size_t pos = atomic_load_explicit(&(pool->head), memory_order_relaxed);
+    size_t seq;
+
+    for (;;) {
+        job = &(pool->jobs[pos & (POOL_QUEUE_SIZE - 1)]);
+        seq = atomic_load_explicit(&(job->seq), memory_order_acquire);
+        if (seq == pos + 1) {
+            if (atomic_compare_exchange_weak_explicit(&(pool->head), &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if ((intptr_t)(seq - (pos + 1)) < 0) {
+            // The cell is still being filled
+            sched_yield();
+            pos = atomic_load_explicit(&(pool->head), memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&(pool->head), memory_order_relaxed);
+        }
+    }
+    out->fn = job->fn;
+    out->arg = job->arg;
+    out->cd = job->cd;
+    atomic_store_explicit(&(job->seq), pos + POOL_QUEUE_SIZE, memory_order_release);
+}
+
+/*
+ * Function: pool_worker
+ * ---------------------
+ * Loop of a worker thread: runs jobs until it dequeues the stop job (fn == NULL).
+ * The result of a job submitted with pool_submit_chan is sent on its channel.
+ */
+static void *pool_worker(void *arg) {
+    pool_t *pool = arg;
+    pool_job_t job;
+    any_t result;
+
+    for (;;) {
+        while (sem_wait(&(pool->items)) != 0)
+            ;
+        job_pop(pool, &job);
+        sem_post(&(pool->slots));
+        if (!job.fn)
+            break;
+
+        result.type = VAR_POINTER;
+        result.value.pointer_val = job.fn(job.arg);
+        if (job.cd > 0)
+            send_chan(job.cd, &result);
+
+        if (ATOMIC_DEC(&(pool->pending)) == 0) {
+            pthread_mutex_lock(&(pool->mutex));
+            pthread_cond_broadcast(&(pool->idle));
+            pthread_mutex_unlock(&(pool->mutex));
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: nth_cpu
+ * -----------------
+ * Returns the n-th CPU of 'set', counting from 0. 'n' must be lower than the
+ * number of CPUs in the set.
+ */
+static int nth_cpu(const cpu_set_t *set, int n) {
+    int cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && n-- == 0)
+            return cpu;
+    }
+    return -1;
+}
+
+/*
+ * Function: pool_start
+ * --------------------
+ * Creates a pool of 'nthreads' workers. If 'pin' is set, worker i is pinned to
+ * the i-th CPU the process may run on (see sched_getaffinity), modulo their
+ * number, so that a restricted affinity mask (taskset, cgroups) is honored.
+ * Workers are not pinned if the mask cannot be read.
+ */
+static pool_t *pool_start(int nthreads, int pin) {
+    pool_t *pool;
+    cpu_set_t allowed;
+    cpu_set_t cpus;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nallowed = 0;
+    size_t i;
+
+    if (ncpu <= 0)
+        ncpu = 1;
+    if (nthreads <= 0)
+        nthreads = (int)ncpu;
+    if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        nallowed = CPU_COUNT(&allowed);
+
+    if (!(pool = calloc(1, sizeof(pool_t))))
+        return NULL;
+    if (!(pool->threads = calloc(nthreads, sizeof(pthread_t)))) {
+        free(pool);
+        return NULL;
+    }
+
+    for (i = 0; i < POOL_QUEUE_SIZE; i++)
+        atomic_init(&(pool->jobs[i].seq), i);
+    atomic_init(&(pool->head), 0);
+    atomic_init(&(pool->tail), 0);
+    atomic_init(&(pool->pending), 0);
+    sem_init(&(pool->items), 0, 0);
+    sem_init(&(pool->slots), 0, POOL_QUEUE_SIZE);
+    pthread_mutex_init(&(pool->mutex), NULL);
+    pthread_cond_init(&(pool->idle), NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&(pool->threads[i]), NULL, pool_worker, pool) != 0)
+            break;
+        if (nallowed > 0) {
+            CPU_ZERO(&cpus);
+            CPU_SET(nth_cpu(&allowed, (int)(i % nallowed)), &cpus);
+            pthread_setaffinity_np(pool->threads[i], sizeof(cpus), &cpus);
+        }
+    }
+    pool->nthreads = i;
+    if (i < nthreads) {
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*
+ * Function: pool_create / pool_create_pinned
+ * ------------------------------------------
+ * Create a pool of 'nthreads' workers (one per online CPU if nthreads <= 0).
+ * pool_create_pinned also pins worker i to the i-th CPU the process may run on,
+ * modulo their number.
+ * Return the pool, or NULL on failure.
+ */
+pool_t *pool_create(int nthreads) {
+    return pool_start(nthreads, 0);
+}
+
+pool_t *pool_create_pinned(int nthreads) {
+    return pool_start(nthreads, 1);
+}
+
+/*
+ * Function: pool_submit_chan
+ * --------------------------
+ * Queue fn(arg) on the pool. If 'cd' is a channel descriptor (> 0), the value returned
+ * by fn is sent on it as a VAR_POINTER once the job finishes. Blocks while the job
+ * queue is full. Returns 0 on success, -1 on invalid arguments.
+ */
+int pool_submit_chan(pool_t *pool, void *(*fn)(void *), void *arg, int cd) {
+    if (!pool || !fn)
+        return -1;
+    ATOMIC_INC(&(pool->pending));
+    while (sem_wait(&(pool->slots)) != 0)
+        ;
+    job_push(pool, fn, arg, cd);
+    sem_post(&(pool->items));
+    return 0;
+}
+
+/*
+ * Function: pool_submit
+ * ---------------------
+ * Queue fn(arg) on the pool and ignore its result. Returns 0 on success, -1 otherwise.
+ */
+int pool_submit(pool_t *pool, void *(*fn)(void *), void *arg) {
+    return pool_submit_chan(pool, fn, arg, 0);
+}
+
+/*
+ * Function: pool_wait
+ * -------------------
+ * Block until every job submitted so far has finished.
+ */
+void pool_wait(pool_t *pool) {
+    pthread_mutex_lock(&(pool->mutex));
+    while (atomic_load(&(pool->pending)) > 0)
+        pthread_cond_wait(&(pool->idle), &(pool->mutex));
+    pthread_mutex_unlock(&(pool->mutex));
+}
+
+/*
+ * Function: pool_destroy
+ * ----------------------
+ * Let the workers finish the queued jobs, stop them and free the pool.
+ */
+void pool_destroy(pool_t *pool) {
+    int i;
+
+    if (!pool)
+        return;
+    // One stop job per worker, queued behind the pending jobs
+    for (i = 0; i < pool->nthreads; i++) {
+        while (sem_wait(&(pool->slots)) != 0)
+            ;
+        job_push(pool, NULL, NULL, 0);
+        sem_post(&(pool->items));
+    }
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    sem_destroy(&(pool->items));
+    sem_destroy(&(pool->slots));
+    pthread_mutex_destroy(&(pool->mutex));
+    pthread_cond_destroy(&(pool->idle));
+    free(pool->threads);
+    free(pool);
+}
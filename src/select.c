@@ -3,6 +3,11 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 #include "libchannel.h"
 #include "waitq.h"
 #include "chan.h"
@@ -10,6 +15,9 @@
 #include "atomic.h"
 #include "chpool.h"
 #include "cvpool.h"
+#include "task.h"
+#include "ctx.h"
+#include "select.h"
 
 void tprintf(const char *format, ...) {
     va_list args;
@@ -61,6 +69,19 @@ static void shuffle_select_set(select_set_t *set, size_t n) {
     }
 }
 
+/*
+ * Function: select_unlock
+ * -----------------------
+ * This function releases the locks taken by `lockall`, then signals the waiters
+ * woken while they were held and runs the continuations of asynchronous operations.
+ *
+ * Returns: void
+ */
+static void select_unlock(int **lockorder, size_t n) {
+    unlockall(lockorder, n);
+    run_deferred();
+}
+
 /*
  * Function: wakeup_next_waiting
  * ----------------------------
@@ -69,8 +90,9 @@ static void shuffle_select_set(select_set_t *set, size_t n) {
  * This function accomplishes its task by dequeuing a condition variable from the queue associated 
  * with the operation type (op_type), which could either be OP_SEND or OP_RECV. It then performs an 
  * atomic compare-and-exchange operation to assign a new value to cv->cd if its current value is 
- * CV_NULL_CHANNEL_DESCRIPTOR. If the operation is successful, the function wakes up the thread associated 
- * with the condition variable and decreases its reference count. 
+ * CV_NULL_CHANNEL_DESCRIPTOR. If the operation is successful, the function queues the wakeup of the thread
+ * associated with the condition variable (see `wake_waiter`), which is issued by `run_deferred` once the
+ * caller released its channel locks.
  *
  * If the compare-and-exchange operation is not successful, the function decreases the reference count 
  * of the condition variable. If its reference count goes to 0, the condition variable is released.
@@ -82,21 +104,18 @@ static void shuffle_select_set(select_set_t *set, size_t n) {
  *
  * Returns: void
  */
-static void wakeup_next_waiting(chan_t *chan, int op_type, int cd) {
+void wakeup_next_waiting(chan_t *chan, int op_type, int cd) {
     condvar_t *cv;
-    pthread_t *thread;
+    int expected;
     int end = 0;
 
-    // Initialize expected value for atomic_compare_exchange_strong
-    int expected = CV_NULL_CHANNEL_DESCRIPTOR;
-
     // Continue the loop until there are no more condition variables to dequeue
     while(!end) {
         // Dequeue the condition variable from the appropriate queue based on the operation type
-        if (op_type == OP_SEND && chan->recv_shift == NULL) {
+        if (op_type == OP_SEND && chan->recv_shift == 0) {
             cv = dequeue(&(chan)->recvq);
         } else {
-            if (op_type == OP_RECV && chan->send_shift == NULL ) {
+            if (op_type == OP_RECV && chan->send_shift == 0) {
                 cv = dequeue(&(chan)->sendq);
             } else {
                 cv = NULL;
@@ -108,27 +127,21 @@ static void wakeup_next_waiting(chan_t *chan, int op_type, int cd) {
             continue;
         }
 
+        // A failed exchange overwrites expected, so reset it for every entry
+        expected = CV_NULL_CHANNEL_DESCRIPTOR;
         // If cv->cd == expected (which is CV_NULL_CHANNEL_DESCRIPTOR), then cv->cd = cd
         // Also, if the exchange was successful, do the following:
         if (atomic_compare_exchange_strong(&(cv->cd), &expected, cd)) {
-            // Lock the condition variable's mutex to avoid race conditions
-            pthread_mutex_lock(&(cv->mutex));
-            // Decrease the reference count of the condition variable
-            ATOMIC_INC(&(cv->ref));
-            // Allocate space for the thread
-            thread  = calloc(1, sizeof(pthread_t));
-            // Copy the thread from the condition variable
-            *thread = cv->thread;
-            // Depending on the operation type, assign the thread to the appropriate field in the channel
+            // Depending on the operation type, reserve the next operation of the channel for the waiter
             if (op_type == OP_SEND) 
-                chan->recv_shift = thread;
+                __atomic_store_n(&(chan->recv_shift), cv->owner, __ATOMIC_RELEASE);
             else
-                chan->send_shift = thread;
+                __atomic_store_n(&(chan->send_shift), cv->owner, __ATOMIC_RELEASE);
 
-            // Signal the condition variable's condition
-            pthread_cond_signal(&(cv->pcond));
-            // Unlock the condition variable's mutex
-            pthread_mutex_unlock(&(cv->mutex));
+            // Queue the wakeup: the waiter is signaled once the channel locks are
+            // released, and the reference held by the dequeued node keeps the
+            // condition variable alive until then
+            wake_waiter(cv);
             end = 1;
 
         } else {
@@ -141,6 +154,66 @@ static void wakeup_next_waiting(chan_t *chan, int op_type, int cd) {
     }
 }
 
+/*
+ * Function: wakeup_all_waiting
+ * ----------------------------
+ * This function wakes up every thread waiting to receive from a 'chan_t', without
+ * reserving the channel for any of them. It is used by the synchronization primitives
+ * whose receive does not consume anything (wait groups and barriers): all the waiters
+ * can complete, so a single pass replaces a chain of wakeups.
+ *
+ * Parameters:
+ * - chan: A pointer to the 'chan_t' structure associated with the waiting threads.
+ * - cd: The descriptor of the channel.
+ *
+ * Returns: void
+ */
+void wakeup_all_waiting(chan_t *chan, int cd) {
+    condvar_t *cv;
+    int expected;
+
+    while ((cv = dequeue(&(chan->recvq))) != NULL) {
+        expected = CV_NULL_CHANNEL_DESCRIPTOR;
+        if (atomic_compare_exchange_strong(&(cv->cd), &expected, cd))
+            wake_waiter(cv);
+        else if (ATOMIC_DEC(&(cv->ref)) == 0)
+            release_condvar(&cv);
+    }
+}
+
+
+/*
+ * Function: select_fast_op
+ * ------------------------
+ * This function performs a send or a receive without the channel lock, on channels
+ * whose buffer synchronizes itself (see select.h).
+ *
+ * Returns:
+ * 1 if the operation was performed, 0 if the caller must take the regular path.
+ */
+int select_fast_op(chan_t *chan, int cd, int op_type, any_t *data) {
+    waitq_t *mine  = (op_type == OP_SEND) ? &(chan->sendq) : &(chan->recvq);
+    waitq_t *peer  = (op_type == OP_SEND) ? &(chan->recvq) : &(chan->sendq);
+    owner_t *shift = (op_type == OP_SEND) ? &(chan->send_shift) : &(chan->recv_shift);
+    int ok;
+
+    if (__atomic_load_n(&(mine->len), __ATOMIC_SEQ_CST) > 0 || __atomic_load_n(shift, __ATOMIC_SEQ_CST) != 0)
+        return 0;
+    ok = (op_type == OP_SEND) ? cb_write(chan->cb, *data) : cb_read(chan->cb, data);
+    if (!ok)
+        return 0;
+
+    // Pairs with the fence of select_enqueue_locked: either the waiter sees the new
+    // length of the buffer, or this thread sees the waiter in the queue
+    atomic_thread_fence(memory_order_seq_cst);
+    if (__atomic_load_n(&(peer->len), __ATOMIC_SEQ_CST) > 0) {
+        chlock_lock(&(chan->lock));
+        wakeup_next_waiting(chan, op_type, cd);
+        chlock_unlock(&(chan->lock));
+        run_deferred();
+    }
+    return 1;
+}
 
 /*
  * Function: select_chan_try_op
@@ -155,13 +228,17 @@ static void wakeup_next_waiting(chan_t *chan, int op_type, int cd) {
  * chan: A pointer to the channel structure on which the operation is to be performed.
  * op_type: An integer representing the type of operation to perform. OP_SEND for a send operation, OP_RECV for a receive operation.
  * data: A void pointer to the data to be sent or the location where the received data should be stored.
+ * key: The key sent with the data, or where the key of the received data is stored. May be NULL.
+ * owner: The identity of the caller, matched against the shift reserved for a woken waiter.
  *
  * Returns:
  * 1 if the operation was successful, and 0 otherwise.
  */
-static int select_chan_try_op(chan_t *chan, int op_type, void *data) {
+static int select_chan_try_op(chan_t *chan, int op_type, void *data, uint64_t *key, owner_t owner) {
 //    waitq_t *wqueue = (op_type == OP_SEND) ? &(chan->sendq) : &(chan->recvq);
     any_t   *value  = data;
+    // Semaphore and wait group counters also move without the lock
+    size_t  prev_len = chan->cb ? __atomic_load_n(&(chan->cb->len), __ATOMIC_RELAXED) : 0;
     int ok;
 
     /* At this point I can try to send or recv because I'm the first or 
@@ -169,29 +246,29 @@ static int select_chan_try_op(chan_t *chan, int op_type, void *data) {
        Depending on the operation type, try to send or receive data. */
     if (op_type == OP_SEND) {
         /* Try to send data to the channel. */
-        if (chan->send_shift == NULL || (chan->send_shift && *(chan->send_shift) == pthread_self())) {
-            ok = cb_write(chan->cb, *value);
-            if (ok && chan->send_shift != NULL) {
-                free(chan->send_shift);
-                chan->send_shift = NULL;
-            }
+        if (chan->send_shift == 0 || chan->send_shift == owner) {
+            ok = cb_write_key(chan->cb, *value, key ? *key : 0);
+            // A reservation that cannot be honored (a lock-free fast path took the
+            // unit first) is dropped, so that the next wakeup can reach the queue
+            if (ok || chan->send_shift == owner)
+                __atomic_store_n(&(chan->send_shift), 0, __ATOMIC_RELEASE);
         } else {
             ok = 0;
         }
     } else {
         /* Try to receive data from the channel. */
-        if (chan->recv_shift == NULL || (chan->recv_shift && *(chan->recv_shift) == pthread_self())) {
-            ok = cb_read(chan->cb, value);
-            if (ok && chan->recv_shift != NULL) {
-                free(chan->recv_shift);
-                chan->recv_shift = NULL;
-            }
+        if (chan->recv_shift == 0 || chan->recv_shift == owner) {
+            ok = cb_read_key(chan->cb, value, key);
+            if (ok || chan->recv_shift == owner)
+                __atomic_store_n(&(chan->recv_shift), 0, __ATOMIC_RELEASE);
         } else {
             ok = 0;
         }
     }
-    if (ok) 
+    if (ok) {
+        chan_notify_ready(chan, prev_len);
         return 1;
+    }
     return 0;
 }
 
@@ -239,8 +316,8 @@ void dump_channel(int cd) {
     printf("Channel info:\n");
     printf("--------------------\n");
 
-    // Print mutex info
-    printf("Mutex: %p\n", (void*)&(channel->mutex));
+    // Print lock info
+    printf("Lock: %p (kind %d)\n", (void*)&(channel->lock), channel->lock.kind);
 
     // Print recvq info
     printf("RecvQ count: %d\n", channel->recvq.len);
@@ -251,14 +328,14 @@ void dump_channel(int cd) {
     printf("SendQ count: %d\n", channel->sendq.len);
     printf("SendQ head: %p\n", (void*)channel->sendq.head);
     printf("SendQ tail: %p\n", (void*)channel->sendq.tail);
-    printf("Recv Shift: %lu\n", channel->recv_shift ? (unsigned long) *(channel->recv_shift): 0);
-    printf("Send Shift: %lu\n", channel->send_shift ? (unsigned long) *(channel->send_shift): 0);
+    printf("Recv Shift: %lu\n", (unsigned long) channel->recv_shift);
+    printf("Send Shift: %lu\n", (unsigned long) channel->send_shift);
     // Print circular buffer info
     if (channel->cb != NULL) {
         printf("Circular Buffer info:\n");
         printf("Start: %d\n", channel->cb->start);
         printf("End: %d\n", channel->cb->end);
-        printf("Len: %lu\n", channel->cb->len);
+        printf("Len: %lu\n", cb_len(channel->cb));
         printf("Cap: %lu\n", channel->cb->cap);
         printf("Buff: %p\n", (void*)channel->cb->buff);
     } else {
@@ -276,6 +353,9 @@ void dump_channel(int cd) {
  * the associated resources. After the waiting period is over, the function returns 
  * the channel descriptor associated with the condition variable.
  *
+ * A task of the task runtime does not block its worker thread: it parks itself and
+ * the worker switches to the next runnable task until the waker makes it runnable.
+ *
  * cvar: double pointer to the condition variable structure. 
  *
  * returns: the channel descriptor associated with the condition variable.
@@ -283,6 +363,14 @@ void dump_channel(int cd) {
 static int wait_and_release(condvar_t **cvar) {
     int cd;
 
+    if ((*cvar)->task) {
+        while ((cd = atomic_load(&((*cvar)->cd))) == CV_NULL_CHANNEL_DESCRIPTOR)
+            task_park();
+        if (ATOMIC_DEC(&((*cvar)->ref)) == 0)
+            release_condvar(cvar);
+        return cd;
+    }
+
     // Acquire the mutex lock
     pthread_mutex_lock(&((*cvar)->mutex));
     // Wait until the channel descriptor is not CV_NULL_CHANNEL_DESCRIPTOR.
@@ -306,6 +394,180 @@ static int wait_and_release(condvar_t **cvar) {
 
 
 
+/*
+ * Function: select_try_one
+ * ------------------------
+ * This function tries one operation of a select set on its channel, which must be
+ * locked. On success, it wakes the next waiter for the opposite operation and, if
+ * the same operation can still complete, passes the wakeup on to the next waiter
+ * for it: one wakeup per free slot (or buffered value) cascades through the queue.
+ *
+ * Returns:
+ * 1 if the operation was performed, 0 otherwise.
+ */
+static int select_try_one(chan_t *chan, select_set_t *pset, owner_t owner) {
+    if (!select_chan_try_op(chan, pset->op_type, (pset->op_type == OP_SEND) ? pset->send : pset->recv, &(pset->key), owner))
+        return 0;
+    wakeup_next_waiting(chan, pset->op_type, pset->cd);
+    if (pset->op_type == OP_SEND ? cb_can_write(chan->cb) : cb_can_read(chan->cb))
+        wakeup_next_waiting(chan, (pset->op_type == OP_SEND) ? OP_RECV : OP_SEND, pset->cd);
+    return 1;
+}
+
+/*
+ * Function: select_looks_ready
+ * ----------------------------
+ * This function tells, without taking the channel lock, whether an operation could
+ * complete: the buffer length allows it and the operation is not reserved for another
+ * waiter. The length and the reservations are single words read atomically, so the
+ * answer is a snapshot that may be stale by the time the channel is locked. Barriers
+ * always look ready, since their readiness depends on the generation of the caller.
+ *
+ * Returns:
+ * 1 if the operation looks possible, 0 otherwise.
+ */
+static int select_looks_ready(chan_t *chan, select_set_t *pset, owner_t owner) {
+    owner_t shift;
+
+    if (chan->cb->kind == CB_BARRIER)
+        return 1;
+    if (pset->op_type == OP_SEND) {
+        shift = __atomic_load_n(&(chan->send_shift), __ATOMIC_ACQUIRE);
+        return (shift == 0 || shift == owner) && cb_can_write(chan->cb);
+    }
+    shift = __atomic_load_n(&(chan->recv_shift), __ATOMIC_ACQUIRE);
+    return (shift == 0 || shift == owner) && cb_can_read(chan->cb);
+}
+
+/*
+ * Function: select_probe
+ * ----------------------
+ * This function is the optimistic first pass of a select. It scans the channels of
+ * the set without locking them, then locks and tries, one at a time, only those whose
+ * operation looks possible.
+ *
+ * Parameters:
+ * - set: a pointer to an array of `select_set_t` structures, already shuffled.
+ * - n: the number of operations in the array.
+ * - owner: the identity of the caller (see `current_owner`).
+ *
+ * Returns:
+ * - The descriptor of the channel whose operation succeeded.
+ * - The negated descriptor of the first channel found closed.
+ * - 0 if no operation looked possible, or every one that did lost a race.
+ */
+static int select_probe(select_set_t *set, size_t n, owner_t owner) {
+    select_set_t *pset;
+    chan_t       *chan;
+    int i;
+    int ok;
+
+    for (i = 0; i < n; i++) {
+        pset = &set[i];
+        if (!(chan = get_channel_from_table(pset->cd)))
+            return -(pset->cd);
+        if (!select_looks_ready(chan, pset, owner))
+            continue;
+
+        chlock_lock(&(chan->lock));
+        ok = select_try_one(chan, pset, owner);
+        chlock_unlock(&(chan->lock));
+        run_deferred();
+        if (ok)
+            return pset->cd;
+    }
+    return 0;
+}
+
+/*
+ * Function: select_try_locked
+ * ---------------------------
+ * This function tries every operation of a select set once, without blocking.
+ * All the channels of the set must already be locked with `lockall`.
+ *
+ * Parameters:
+ * - set: a pointer to an array of `select_set_t` structures.
+ * - n: the number of operations in the array.
+ * - owner: the identity of the caller (see `current_owner`).
+ *
+ * Returns:
+ * - The descriptor of the channel whose operation succeeded. The next waiter for
+ *   the opposite operation on that channel has been woken up.
+ * - The negated descriptor of the first channel found closed.
+ * - 0 if no operation could be performed.
+ */
+static int select_try_locked(select_set_t *set, size_t n, owner_t owner) {
+    select_set_t *pset;
+    chan_t       *chan;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        pset = &set[i];
+        chan = get_channel_from_table(pset->cd);
+
+        // Check if channel is closed or does not exist
+        if (!chan)
+            return -(pset->cd);
+
+        // Try to perform the operation
+        if (select_try_one(chan, pset, owner))
+            return pset->cd;
+    }
+    return 0;
+}
+
+/*
+ * Function: select_enqueue_locked
+ * -------------------------------
+ * This function enqueues a condition variable in the wait queue of every operation
+ * of a select set, taking one reference on the condition variable per queue.
+ * All the channels of the set must already be locked with `lockall`.
+ *
+ * Parameters:
+ * - set: a pointer to an array of `select_set_t` structures.
+ * - n: the number of operations in the array.
+ * - cvar: the condition variable the calling thread will wait on.
+ *
+ * Returns: void
+ */
+static void select_enqueue_locked(select_set_t *set, size_t n, condvar_t *cvar) {
+    select_set_t *pset;
+    chan_t       *chan;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        pset = &set[i];
+        chan = get_channel_from_table(pset->cd);
+
+        // Increase the reference count of the condition variable
+        ATOMIC_INC(&(cvar->ref));
+        // Enqueue the condition variable in the appropriate queue
+        if (pset->op_type == OP_SEND)
+            enqueue(&(chan->sendq), cvar);
+        else
+            enqueue(&(chan->recvq), cvar);
+    }
+
+    // The counters of semaphores and wait groups, and the shards of sharded channels,
+    // also change without the channel lock (see select_fast_op and sync.c). Their fast
+    // paths update the buffer and then look at the wait queues; here the queues were
+    // updated, so look at the buffers again and wake a waiter if one became ready in
+    // between.
+    atomic_thread_fence(memory_order_seq_cst);
+    for (i = 0; i < n; i++) {
+        pset = &set[i];
+        chan = get_channel_from_table(pset->cd);
+        if (chan->cb->kind != CB_COUNTER && chan->cb->kind != CB_WAITGROUP && chan->cb->kind != CB_SHARDED)
+            continue;
+        if (pset->op_type == OP_SEND ? !cb_can_write(chan->cb) : !cb_can_read(chan->cb))
+            continue;
+        if (chan->cb->kind == CB_WAITGROUP)
+            wakeup_all_waiting(chan, pset->cd);
+        else
+            wakeup_next_waiting(chan, (pset->op_type == OP_SEND) ? OP_RECV : OP_SEND, pset->cd);
+    }
+}
+
 /*
  * Function: select_chan_op
  * ------------------------
@@ -324,20 +586,20 @@ static int wait_and_release(condvar_t **cvar) {
  * - The function returns the result of `select_chan_loop` function, if the condition variable is signaled.
  *
  * Notes:
- * - This function uses two loops. The first loop attempts to perform the select operation on the channels. If unsuccessful,
- *   it increments the reference count of the condition variable and enqueues the condition variable to the appropriate queue
- *   based on the operation type (send or receive).
+ * - `select_probe` first reads the length and reservations of every channel without locking, and locks and
+ *   tries only the channels that look ready, one at a time. A non-blocking select returns after this pass.
+ * - Otherwise the function works in two passes. `select_try_locked` attempts to perform the select operation on the channels. If
+ *   unsuccessful, `select_enqueue_locked` increments the reference count of the condition variable and enqueues the
+ *   condition variable to the appropriate queue based on the operation type (send or receive).
  * - After all channels have been processed, the function releases all locks using `unlockall`.
  * - It then enters a blocking state, waiting for a condition to be signaled.
  * - Once signaled, it obtains the index of the signaled condition variable and performs the select operation again on that channel.
  */
 int select_chan_op(select_set_t *set, size_t n, int should_block) {
-    select_set_t *pset;
-    chan_t       *chan;
     condvar_t    *cvar;
     int i;
     int cd;
-    int success;
+    int ret;
     int *lockorder;
 
     // If no operations are specified, return -1
@@ -348,59 +610,33 @@ int select_chan_op(select_set_t *set, size_t n, int should_block) {
     if (n > 1)
         shuffle_select_set(set, n);
 
+    // Try the channels that look ready one at a time, without the lock ordering. A
+    // non-blocking select ends here; a blocking one locks everything only to park
+    if ((ret = select_probe(set, n, current_owner())) != 0 || !should_block)
+        return ret;
+
     // Lock all the channels in ascending order to prevent deadlocks
     lockorder = lockall(set, n);
 
-    // Try to perform all operations without blocking
-    for (i = 0; i < n; i++) {
-        pset = &set[i];
-        chan = get_channel_from_table(pset->cd);
-
-        // Check if channel is closed or does not exist
-        if (!chan) {
-            unlockall(&lockorder, n);
-            return -(pset->cd);
-        }
-
-        // Try to perform the operation
-        if ((success = select_chan_try_op(chan, pset->op_type, (pset->op_type == OP_SEND) ? pset->send : pset->recv))) {
-            // If the operation was successful, wake up the next thread waiting for the opposite operation
-            wakeup_next_waiting(chan, pset->op_type, pset->cd);
-            // Unlock all the channels
-            unlockall(&lockorder, n);
-            // Return success
-            return pset->cd;
-        }
-    }
-
-    // If should_block is false, we unlock all channels and return the result of the operations (successful or not)
-    if (!should_block) {
-        unlockall(&lockorder, n);
-        return 0;
+    // Try to perform all operations without blocking. If one succeeded or a channel
+    // is closed, or if should_block is false, unlock all channels and return the result
+    if ((ret = select_try_locked(set, n, current_owner())) != 0 || !should_block) {
+        select_unlock(&lockorder, n);
+        return ret;
     }
 
     // If should_block is true and no operation was successful, we block until an operation can be performed
 
     // Create a new condition variable and set its thread to the current one
     cvar = empty_condvar();
-    cvar->thread = pthread_self();
+    cvar->owner = current_owner();
+    cvar->task = task_self();
     ATOMIC_INC(&(cvar->ref));
     // Enqueue the condition variable in the waiting queue of each operation
-    for (i = 0; i < n; i++) {
-        pset = &set[i];
-        chan = get_channel_from_table(pset->cd);
-
-        // Increase the reference count of the condition variable
-        ATOMIC_INC(&(cvar->ref));
-        // Enqueue the condition variable in the appropriate queue
-        if (pset->op_type == OP_SEND)
-            enqueue(&(chan->sendq), cvar);
-        else
-            enqueue(&(chan->recvq), cvar);
-    }
+    select_enqueue_locked(set, n, cvar);
 
     // Unlock all the channels
-    unlockall(&lockorder, n);
+    select_unlock(&lockorder, n);
 
     // Wait until one of the operations can be performed and get the channel descriptor of the operation
     cd = wait_and_release(&cvar);
@@ -432,6 +668,462 @@ int select_chan(select_set_t *set, size_t n, int should_block) {
     return select_chan_op(set, n, should_block);
 } 
 
+/*
+ * Function: cancel_wait
+ * ---------------------
+ * This function withdraws a condition variable from the channels it was enqueued on.
+ * It marks the condition variable as cancelled so that wakers skip its stale queue
+ * nodes, and drops the reference held by the waiting thread.
+ *
+ * Parameters:
+ * cvar: double pointer to the condition variable structure.
+ *
+ * Returns:
+ * CV_CANCELLED_CHANNEL_DESCRIPTOR if the wait was withdrawn. If a channel claimed the
+ * condition variable first, its descriptor is returned instead and the caller still
+ * owns the wait: it must complete the operation on that channel.
+ */
+static int cancel_wait(condvar_t **cvar) {
+    int cd = CV_NULL_CHANNEL_DESCRIPTOR;
+
+    if (!atomic_compare_exchange_strong(&((*cvar)->cd), &cd, CV_CANCELLED_CHANNEL_DESCRIPTOR))
+        return cd;
+    if (ATOMIC_DEC(&((*cvar)->ref)) == 0)
+        release_condvar(cvar);
+    return CV_CANCELLED_CHANNEL_DESCRIPTOR;
+}
+
+/*
+ * Function: remaining_ms
+ * ----------------------
+ * Returns the milliseconds left until 'deadline' (CLOCK_MONOTONIC), never less than 0.
+ */
+static int remaining_ms(const struct timespec *deadline) {
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+/*
+ * Function: select_chan_ctx
+ * -------------------------
+ * This function performs a blocking select under a cancellation context.
+ *
+ * It behaves like select_chan with SELECT_BLOCK, except that while it waits its
+ * condition variable is also registered on 'ctx': cancelling the context claims
+ * it and wakes the caller. An operation that can complete immediately does so
+ * even if the context is already cancelled.
+ *
+ * Parameters:
+ * - ctx: the cancellation context, or NULL to wait without one.
+ * - set: a pointer to an array of `select_set_t` structures.
+ * - n: the number of operations in the array.
+ *
+ * Returns:
+ * - The descriptor of the channel whose operation was performed.
+ * - The negated descriptor of a closed channel.
+ * - SELECT_CANCELLED if the context was cancelled first.
+ */
+int select_chan_ctx(ctx_t *ctx, select_set_t *set, size_t n) {
+    ctx_wait_t  w;
+    condvar_t  *cvar;
+    int *lockorder;
+    int ret;
+    int cd;
+    int i;
+
+    if (!ctx)
+        return select_chan_op(set, n, SELECT_BLOCK);
+    if (n == 0)
+        return 0;
+    if (n > 1)
+        shuffle_select_set(set, n);
+
+    lockorder = lockall(set, n);
+    if ((ret = select_try_locked(set, n, current_owner())) != 0) {
+        select_unlock(&lockorder, n);
+        return ret;
+    }
+
+    cvar = empty_condvar();
+    cvar->owner = current_owner();
+    cvar->task = task_self();
+    ATOMIC_INC(&(cvar->ref));
+    select_enqueue_locked(set, n, cvar);
+    select_unlock(&lockorder, n);
+
+    if (ctx_register(ctx, &w, cvar) == 0) {
+        cd = wait_and_release(&cvar);
+        ctx_unregister(ctx, &w);
+    } else if ((cd = cancel_wait(&cvar)) != CV_CANCELLED_CHANNEL_DESCRIPTOR) {
+        // A channel claimed the wait before it could be withdrawn
+        if (ATOMIC_DEC(&(cvar->ref)) == 0)
+            release_condvar(&cvar);
+    }
+    if (cd == CV_CANCELLED_CHANNEL_DESCRIPTOR)
+        return SELECT_CANCELLED;
+
+    // The channel is reserved for us: complete the operation even if the context
+    // gets cancelled meanwhile, or the reservation would block the channel
+    i = loockup_cd(set, n, cd);
+    return select_chan_ctx(ctx, &set[i], 1);
+}
+
+/*
+ * Function: send_chan_ctx / recv_chan_ctx
+ * ---------------------------------------
+ * Blocking send and receive under a cancellation context. They return the
+ * channel descriptor on success, its negation if the channel is closed, and
+ * SELECT_CANCELLED if the context was cancelled first.
+ */
+int send_chan_ctx(ctx_t *ctx, int cd, any_t *send) {
+    select_set_t op[] = {
+        {cd, OP_SEND, send, NULL},  // Define a channel operation for sending.
+    };
+    return select_chan_ctx(ctx, op, 1);
+}
+
+int recv_chan_ctx(ctx_t *ctx, int cd, any_t *recv) {
+    select_set_t op[] = {
+        {cd, OP_RECV, NULL, recv},  // Define a channel operation for receiving.
+    };
+    return select_chan_ctx(ctx, op, 1);
+}
+
+/*
+ * Function: select_chan_fds
+ * -------------------------
+ * This function waits on a set of channel operations and a set of file descriptors
+ * at the same time, and returns as soon as one of them is ready.
+ *
+ * The channel operations are tried first. If none can be performed, the calling
+ * thread enqueues itself on every channel like select_chan does, but parks on its
+ * per-thread eventfd instead of a condition variable, so one poll() call is woken
+ * either by channel activity or by readiness of the file descriptors.
+ *
+ * Parameters:
+ * - set: a pointer to an array of `select_set_t` structures (may be NULL if n == 0).
+ * - n: the number of channel operations in the array.
+ * - fds: a pointer to an array of `struct pollfd`, as for poll() (may be NULL if nfds == 0).
+ * - nfds: the number of file descriptors in the array.
+ * - timeout: the maximum time to wait in milliseconds, -1 to wait forever, 0 to poll.
+ *
+ * Returns:
+ * - The descriptor of the channel whose operation was performed.
+ * - SELECT_FD_READY if at least one file descriptor is ready; its revents are set.
+ * - 0 if the timeout expired.
+ * - The negated descriptor of a closed channel, as select_chan does.
+ * - SELECT_FD_ERROR if poll() failed or the parker could not be created; errno is set.
+ */
+int select_chan_fds(select_set_t *set, size_t n, struct pollfd *fds, size_t nfds, int timeout) {
+    struct pollfd   stack_pfds[16];
+    struct pollfd   *pfds;
+    struct timespec deadline;
+    condvar_t       *cvar;
+    eventfd_t       drain;
+    int *lockorder = NULL;
+    int efd;
+    int ret;
+    int status;
+    int cd;
+    int i;
+
+    if (n > 1)
+        shuffle_select_set(set, n);
+
+    // Try the channel operations first
+    if (n > 0) {
+        lockorder = lockall(set, n);
+        if ((ret = select_try_locked(set, n, current_owner())) != 0) {
+            select_unlock(&lockorder, n);
+            return ret;
+        }
+    }
+
+    // Nothing to park on when not blocking: only check the file descriptors
+    if (timeout == 0) {
+        if (n > 0)
+            select_unlock(&lockorder, n);
+        if (nfds == 0)
+            return 0;
+        ret = poll(fds, nfds, 0);
+        return ret > 0 ? SELECT_FD_READY : (ret == 0 ? 0 : SELECT_FD_ERROR);
+    }
+
+    if ((efd = thread_parker_fd()) < 0) {
+        if (n > 0)
+            select_unlock(&lockorder, n);
+        return SELECT_FD_ERROR;
+    }
+
+    pfds = nfds < 16 ? stack_pfds : calloc(nfds + 1, sizeof(struct pollfd));
+    if (!pfds) {
+        if (n > 0)
+            select_unlock(&lockorder, n);
+        errno = ENOMEM;
+        return SELECT_FD_ERROR;
+    }
+    for (i = 0; i < nfds; i++)
+        pfds[i] = fds[i];
+    pfds[nfds].fd = efd;
+    pfds[nfds].events = POLLIN;
+
+    // Enqueue on every channel, parking on the thread's eventfd
+    cvar = empty_condvar();
+    cvar->owner = current_owner();
+    cvar->efd = efd;
+    ATOMIC_INC(&(cvar->ref));
+    if (n > 0) {
+        select_enqueue_locked(set, n, cvar);
+        select_unlock(&lockorder, n);
+    }
+
+    if (timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    for (;;) {
+        if ((ret = poll(pfds, nfds + 1, timeout)) < 0 && errno != EINTR) {
+            status = SELECT_FD_ERROR;
+        } else {
+            status = 0;
+            if (ret > 0 && pfds[nfds].revents) {
+                // Drain the parker; a stale wakeup left by an earlier wait is harmless
+                eventfd_read(efd, &drain);
+                ret--;
+            }
+            if (ret > 0)
+                status = SELECT_FD_READY;
+        }
+
+        // Woken by a channel
+        if ((cd = atomic_load(&(cvar->cd))) != CV_NULL_CHANNEL_DESCRIPTOR)
+            break;
+
+        if (status == 0 && timeout > 0)
+            timeout = remaining_ms(&deadline);
+
+        if (status != 0 || timeout == 0) {
+            if ((cd = cancel_wait(&cvar)) == CV_CANCELLED_CHANNEL_DESCRIPTOR) {
+                for (i = 0; i < nfds; i++)
+                    fds[i].revents = pfds[i].revents;
+                if (pfds != stack_pfds)
+                    free(pfds);
+                return status;
+            }
+            // A channel claimed this wait before it could be withdrawn
+            break;
+        }
+    }
+
+    // A channel was reserved for this thread: drop our reference and complete the operation
+    for (i = 0; i < nfds; i++)
+        fds[i].revents = 0;
+    if (pfds != stack_pfds)
+        free(pfds);
+    if (ATOMIC_DEC(&(cvar->ref)) == 0)
+        release_condvar(&cvar);
+    i = loockup_cd(set, n, cd);
+    return select_chan_op(&set[i], 1, SELECT_BLOCK);
+}
+
+/*
+ * Function: select_chan_async
+ * ---------------------------
+ * This function starts an asynchronous select: it never blocks the calling thread.
+ *
+ * If one of the operations can be performed now, it is performed and its channel
+ * descriptor returned. Otherwise a wait node that refers to 'op' instead of a
+ * parked thread is enqueued on every channel, and 0 is returned. When a channel
+ * becomes ready for the operation, the waker reserves it for 'op' (the address of
+ * 'op' is its owner) and, once it has released its channel locks, calls op->ready.
+ * The continuation then completes the operation with select_chan_async_resume.
+ *
+ * Parameters:
+ * - set: a pointer to an array of `select_set_t` structures. It must stay valid
+ *   until the operation completes, and must be passed again to the resume call.
+ * - n: the number of operations in the array, at least 1.
+ * - op: the asynchronous operation, with its ready callback set.
+ *
+ * Returns:
+ * - The descriptor of the channel whose operation was performed.
+ * - The negated descriptor of a closed channel.
+ * - -1 if n is 0: there is nothing to wait for, and op->ready is never called.
+ * - 0 if the operation is pending. op->ready may then run on another thread even
+ *   before this function returns.
+ */
+int select_chan_async(select_set_t *set, size_t n, chan_async_t *op) {
+    condvar_t *cvar;
+    int *lockorder;
+    int ret;
+
+    // Nothing could ever call op->ready: fail now rather than report it pending
+    if (n == 0)
+        return -1;
+    if (n > 1)
+        shuffle_select_set(set, n);
+
+    lockorder = lockall(set, n);
+    if ((ret = select_try_locked(set, n, (owner_t)op)) != 0) {
+        select_unlock(&lockorder, n);
+        return ret;
+    }
+
+    // Enqueue a wait node that completes 'op' instead of waking a thread
+    cvar = empty_condvar();
+    cvar->owner = (owner_t)op;
+    cvar->async = op;
+    op->waiter = cvar;
+    op->next = NULL;
+    ATOMIC_INC(&(cvar->ref));
+    select_enqueue_locked(set, n, cvar);
+    select_unlock(&lockorder, n);
+    return 0;
+}
+
+/*
+ * Function: select_chan_async_resume
+ * ----------------------------------
+ * This function completes an asynchronous select after op->ready was called: it
+ * performs the operation on the channel that was reserved for 'op'.
+ *
+ * Parameters:
+ * - set: the array passed to select_chan_async.
+ * - n: the number of operations in the array.
+ * - op: the asynchronous operation.
+ *
+ * Returns:
+ * The same values as select_chan_async. If 0 is returned, the operation is
+ * pending again and op->ready will be called another time.
+ */
+int select_chan_async_resume(select_set_t *set, size_t n, chan_async_t *op) {
+    condvar_t *cvar = op->waiter;
+    int cd = atomic_load(&(cvar->cd));
+    int i;
+
+    // Drop the reference held on behalf of the operation
+    op->waiter = NULL;
+    if (ATOMIC_DEC(&(cvar->ref)) == 0)
+        release_condvar(&cvar);
+
+    i = loockup_cd(set, n, cd);
+    return select_chan_async(&set[i], 1, op);
+}
+
+/*
+ * Function: send_lossy
+ * --------------------
+ * Send path of channels with a drop policy. Such a send always completes, so it
+ * locks the channel alone and skips the shuffle, lock ordering and wait queue
+ * setup of select_chan.
+ *
+ * Returns:
+ *    The channel descriptor, or 0 if the write was refused (the next send is
+ *    reserved for a woken waiter), so that a lost value is not reported as sent:
+ *    the caller then takes the regular path.
+ */
+static int send_lossy(chan_t *chan, int cd, any_t *send) {
+    int ok;
+
+    chlock_lock(&(chan->lock));
+    if ((ok = select_chan_try_op(chan, OP_SEND, send, NULL, current_owner())) != 0)
+        wakeup_next_waiting(chan, OP_SEND, cd);
+    chlock_unlock(&(chan->lock));
+    run_deferred();
+    return ok ? cd : 0;
+}
+
+/*
+ * Function: combine_locked
+ * ------------------------
+ * Applies the sends published on a flat-combining channel, oldest first, and marks
+ * each record FC_DONE or FC_FULL. The list is drained up to FC_MAX_PASSES times so
+ * that sends published meanwhile ride along, without keeping the combiner forever.
+ * One receiver is woken if anything was sent; the cascade in select_try_locked wakes
+ * the others while values remain. Must be called with the channel locked.
+ */
+#define FC_MAX_PASSES 4
+
+static void combine_locked(chan_t *chan, int cd) {
+    fc_rec_t *list;
+    fc_rec_t *rec;
+    fc_rec_t *next;
+    int pass;
+    int ok;
+    int sent = 0;
+
+    for (pass = 0; pass < FC_MAX_PASSES; pass++) {
+        if ((list = atomic_exchange(&(chan->fc_pending), NULL)) == NULL)
+            break;
+        // The list is a stack: reverse it to apply the sends in publication order
+        for (rec = NULL; list; list = next) {
+            next = list->next;
+            list->next = rec;
+            rec = list;
+        }
+        for (; rec; rec = next) {
+            // The record belongs to its sender again as soon as its status is set
+            next = rec->next;
+            ok = select_chan_try_op(chan, OP_SEND, &(rec->val), NULL, rec->owner);
+            sent |= ok;
+            atomic_store_explicit(&(rec->status), ok ? FC_DONE : FC_FULL, memory_order_release);
+        }
+    }
+    if (sent)
+        wakeup_next_waiting(chan, OP_SEND, cd);
+}
+
+/*
+ * Function: send_combined
+ * -----------------------
+ * Send path of channels created with CHAN_COMBINING. The value is published on the
+ * channel, then the sender either takes the lock and applies every published send
+ * (its own included), or spins until the current lock holder did it. The lock is
+ * taken once per batch instead of once per message. A send that found the channel
+ * full falls back to the regular path, which blocks on the wait queue.
+ *
+ * Returns:
+ *    The channel descriptor on success, 0 if the channel is full and should_block
+ *    is not set.
+ */
+static int send_combined(chan_t *chan, int cd, any_t *send, int should_block) {
+    fc_rec_t rec;
+    int spins = 0;
+
+    rec.val = *send;
+    rec.owner = current_owner();
+    atomic_init(&(rec.status), FC_PENDING);
+    rec.next = atomic_load(&(chan->fc_pending));
+    while (!atomic_compare_exchange_weak(&(chan->fc_pending), &(rec.next), &rec))
+        ;
+
+    while (atomic_load_explicit(&(rec.status), memory_order_acquire) == FC_PENDING) {
+        if (chlock_trylock(&(chan->lock)) == 0) {
+            combine_locked(chan, cd);
+            chlock_unlock(&(chan->lock));
+            run_deferred();
+        } else if (++spins % 64 == 0) {
+            sched_yield();
+        }
+    }
+    if (atomic_load(&(rec.status)) == FC_DONE)
+        return cd;
+
+    select_set_t op[] = {
+        {cd, OP_SEND, send, NULL},  // Define a channel operation for sending.
+    };
+    return select_chan(op, 1, should_block);
+}
+
 /*
  * Function: send_chan
  * -------------------
@@ -446,13 +1138,18 @@ int select_chan(select_set_t *set, size_t n, int should_block) {
  *    If the operation was not successful, it returns -1.
  */
 int send_chan(int cd, any_t *send) {
-    select_set_t op[] = {
-        {cd, OP_SEND, send, NULL},  // Define a channel operation for sending.
-    };
-    return select_chan(op, 1, SELECT_BLOCK);  // Attempt to perform the operation.
+    return send_chan_bctrl(cd, send, SELECT_BLOCK);
 }
 
 int send_chan_bctrl(int cd, any_t *send, int should_block) {
+    chan_t *chan = get_channel_from_table(cd);
+    if (chan && chan->combining)
+        return send_combined(chan, cd, send, should_block);
+    if (chan && chan->cb && chan->cb->kind == CB_SHARDED && select_fast_op(chan, cd, OP_SEND, send))
+        return cd;
+    if (chan && chan->cb && chan->cb->policy != CB_BLOCK && send_lossy(chan, cd, send))
+        return cd;
+
     select_set_t op[] = {
         {cd, OP_SEND, send, NULL},  // Define a channel operation for sending.
     };
@@ -473,19 +1170,35 @@ int send_chan_bctrl(int cd, any_t *send, int should_block) {
  *    If the operation was not successful, it returns -1.
  */
 int recv_chan(int cd, any_t *recv) {
-    select_set_t op[] = {
-        {cd, OP_RECV, NULL, recv},  // Define a channel operation for receiving.
-    };
-    return select_chan(op, 1, SELECT_BLOCK);  // Attempt to perform the operation.
+    return recv_chan_bctrl(cd, recv, SELECT_BLOCK);
 }
 
 int recv_chan_bctrl(int cd, any_t *recv, int should_block) {
+    chan_t *chan = get_channel_from_table(cd);
+    if (chan && chan->cb && chan->cb->kind == CB_SHARDED && select_fast_op(chan, cd, OP_RECV, recv))
+        return cd;
+
     select_set_t op[] = {
         {cd, OP_RECV, NULL, recv},  // Define a channel operation for receiving.
     };
     return select_chan(op, 1, should_block);  // Attempt to perform the operation.
 }
 
+/*
+ * Function: chan_try_op
+ * ---------------------
+ * This function is the slow path of chan_try_send and chan_try_recv, once their
+ * inline check found that the operation may complete.
+ *
+ * Returns:
+ *    The same values as send_chan_bctrl and recv_chan_bctrl with SELECT_NONBLOCK.
+ */
+int chan_try_op(chan_handle_t *h, int op_type, any_t *data) {
+    if (op_type == OP_SEND)
+        return send_chan_bctrl(h->cd, data, SELECT_NONBLOCK);
+    return recv_chan_bctrl(h->cd, data, SELECT_NONBLOCK);
+}
+
 
 /*
  * Function: cap
@@ -498,7 +1211,7 @@ int recv_chan_bctrl(int cd, any_t *recv, int should_block) {
  * properly initialized.
  *
  * If the channel is NULL or hasn't been properly initialized,
- * the function returns a zero.
+ * the function returns a zero. Unbounded channels report INT_MAX.
  *
  * Parameters:
  * chan: The channel whose capacity we want to find out.
@@ -508,13 +1221,11 @@ int recv_chan_bctrl(int cd, any_t *recv, int should_block) {
  */
 int cap(int cd) {
     chan_t *chan = get_channel_from_table(cd);
-    int _cap = 0;
-    if (chan && chan->cb) {
-        pthread_mutex_lock(&(chan->mutex));
-        _cap = chan->cb->cap;
-        pthread_mutex_unlock(&(chan->mutex));
-    }
-    return _cap;
+    size_t _cap = 0;
+    // A single word read: resize_chan stores it atomically, no lock needed
+    if (chan && chan->cb)
+        _cap = __atomic_load_n(&(chan->cb->cap), __ATOMIC_RELAXED);
+    return _cap > INT_MAX ? INT_MAX : (int)_cap;
 }
 
 /*
@@ -537,11 +1248,172 @@ int cap(int cd) {
  */
 int len(int cd) {
     chan_t *chan = get_channel_from_table(cd);
-    int _len = 0;
+    size_t _len = 0;
+    // A snapshot, as it would be by the time the caller looks at it anyway
+    if (chan && chan->cb)
+        _len = cb_len(chan->cb);
+    return _len > INT_MAX ? INT_MAX : (int)_len;
+}
+
+/*
+ * Function: send_chan_key
+ * -----------------------
+ * This function sends data with a key. On a channel created with
+ * make_chan_keyed, it replaces the pending value with the same key, if any.
+ * Other channels ignore the key.
+ *
+ * Parameters:
+ *    cd   - the descriptor of the channel to send to.
+ *    key  - the key of the data.
+ *    send - a pointer to the data to be sent.
+ *
+ * Returns:
+ *    The same values as send_chan.
+ */
+int send_chan_key(int cd, uint64_t key, any_t *send) {
+    select_set_t op[] = {
+        {cd, OP_SEND, send, NULL, key},  // Define a channel operation for sending.
+    };
+    return select_chan(op, 1, SELECT_BLOCK);  // Attempt to perform the operation.
+}
+
+/*
+ * Function: recv_chan_key
+ * -----------------------
+ * This function receives data and its key from a channel. The key is 0 for
+ * channels without keys.
+ *
+ * Parameters:
+ *    cd   - the descriptor of the channel to receive from.
+ *    key  - where the key of the received data is stored.
+ *    recv - a pointer to a location where the received data should be stored.
+ *
+ * Returns:
+ *    The same values as recv_chan.
+ */
+int recv_chan_key(int cd, uint64_t *key, any_t *recv) {
+    select_set_t op[] = {
+        {cd, OP_RECV, NULL, recv, 0},  // Define a channel operation for receiving.
+    };
+    int ret = select_chan(op, 1, SELECT_BLOCK);  // Attempt to perform the operation.
+    *key = op[0].key;
+    return ret;
+}
+
+/*
+ * Function: send_chan_prio
+ * ------------------------
+ * This function sends data with a priority. On a channel created with
+ * make_chan_prio, receivers get the values of highest priority first.
+ * Other channels ignore the priority, except keyed channels where it is
+ * the key.
+ *
+ * Parameters:
+ *    cd   - the descriptor of the channel to send to.
+ *    prio - the priority of the data, higher is more urgent.
+ *    send - a pointer to the data to be sent.
+ *
+ * Returns:
+ *    The same values as send_chan.
+ */
+int send_chan_prio(int cd, uint64_t prio, any_t *send) {
+    return send_chan_key(cd, prio, send);
+}
+
+/*
+ * Function: dropped_chan
+ * --------------------
+ * This function returns the number of values a channel created with
+ * make_chan_flags discarded because it was full, or the number of values a
+ * keyed channel replaced by newer ones.
+ *
+ * Parameters:
+ * cd: The channel descriptor.
+ *
+ * Returns:
+ * The number of dropped values, or zero if the channel does not exist.
+ */
+uint64_t dropped_chan(int cd) {
+    chan_t *chan = get_channel_from_table(cd);
+    uint64_t dropped = 0;
     if (chan && chan->cb) {
-        pthread_mutex_lock(&(chan->mutex));
-        _len = chan->cb->len;
-        pthread_mutex_unlock(&(chan->mutex));
+        chlock_lock(&(chan->lock));
+        dropped = chan->cb->dropped;
+        chlock_unlock(&(chan->lock));
+    }
+    return dropped;
+}
+
+/*
+ * Function: resize_chan
+ * --------------------
+ * This function changes the capacity of a channel while it is in use.
+ *
+ * The buffered values are moved, in order, to a new buffer of 'new_cap'
+ * slots under the channel lock. If the capacity grows, the next parked
+ * sender is woken up; each sender that finds room left after its send wakes
+ * the following one, so the new slots are filled by as many senders.
+ *
+ * Only channels created with make_chan can be resized, and never below
+ * the number of values they currently hold.
+ *
+ * Parameters:
+ * cd: The channel descriptor.
+ * new_cap: The new capacity, at least 1.
+ *
+ * Returns:
+ * 0 on success, -1 if the channel does not exist or cannot be resized
+ * to new_cap.
+ */
+int resize_chan(int cd, size_t new_cap) {
+    chan_t *chan = get_channel_from_table(cd);
+    size_t prev_cap;
+    int ret = -1;
+
+    if (!chan || !chan->cb)
+        return -1;
+    chlock_lock(&(chan->lock));
+    prev_cap = chan->cb->cap;
+    if (cb_resize(chan->cb, new_cap)) {
+        chan_notify_resized(chan, prev_cap);
+        if (new_cap > prev_cap && chan->cb->len < new_cap)
+            wakeup_next_waiting(chan, OP_RECV, cd);
+        ret = 0;
+    }
+    chlock_unlock(&(chan->lock));
+    run_deferred();
+    return ret;
+}
+
+/*
+ * Function: chan_fd
+ * --------------------
+ * This function returns a readiness file descriptor for the channel.
+ *
+ * The descriptor is an eventfd that is readable while the given operation
+ * could complete without blocking: while the channel holds data for OP_RECV,
+ * and while it has free space for OP_SEND. It can be registered in epoll,
+ * poll or select loops. The library only writes to it on empty<->non-empty
+ * and full<->non-full transitions, so the caller must never read from it.
+ *
+ * The descriptor is created on first use and owned by the channel; it is
+ * closed when the channel is closed.
+ *
+ * Parameters:
+ * cd: The channel descriptor.
+ * op_type: OP_RECV or OP_SEND.
+ *
+ * Returns:
+ * The readiness file descriptor, or -1 if the channel does not exist or the
+ * descriptor could not be created.
+ */
+int chan_fd(int cd, int op_type) {
+    chan_t *chan = get_channel_from_table(cd);
+    int fd = -1;
+    if (chan && chan->cb && (op_type == OP_SEND || op_type == OP_RECV)) {
+        chlock_lock(&(chan->lock));
+        fd = chan_ready_fd(chan, op_type);
+        chlock_unlock(&(chan->lock));
     }
-    return _len;
-}
\ No newline at end of file
+    return fd;
+}
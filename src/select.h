@@ -0,0 +1,49 @@
+/*
+ * File: select.h
+ * ----------------------------
+ * This header file includes the functions of select.c used by the other modules of
+ * the library. The wakeup functions must be called with the channel locked; the
+ * caller then runs `run_deferred` once it released the lock.
+ *
+ * Functions:
+ * wakeup_next_waiting: Wakes the next waiter for the opposite of an operation.
+ * wakeup_all_waiting: Wakes every receiver waiting on a channel.
+ * select_fast_op: Performs an operation without the channel lock, when the buffer allows it.
+ */
+#ifndef _LC_SELECT_H
+#define _LC_SELECT_H 1
+
+#include "chan.h"
+
+/*
+ * Function: wakeup_next_waiting
+ * ----------------------------
+ * Wakes the next waiter for the opposite of 'op_type' on a channel, and reserves
+ * the next such operation of the channel for it.
+ */
+extern void wakeup_next_waiting(chan_t *chan, int op_type, int cd);
+
+/*
+ * Function: wakeup_all_waiting
+ * ----------------------------
+ * Wakes every receiver waiting on a channel, without reserving anything for them.
+ * Used by primitives whose receive does not consume anything, such as wait groups
+ * and barriers: every waiter can complete.
+ */
+extern void wakeup_all_waiting(chan_t *chan, int cd);
+
+/*
+ * Function: select_fast_op
+ * ------------------------
+ * Performs a send or a receive without taking the channel lock, on a channel whose
+ * buffer synchronizes itself (CB_COUNTER, CB_SHARDED). It gives up when waiters for
+ * the same operation are queued or the operation is reserved for one of them, so
+ * that the caller queues behind them. The channel is locked only to wake a waiter
+ * for the opposite operation, if there is one.
+ *
+ * Returns: 1 if the operation was performed, 0 if the caller must take the
+ * regular path.
+ */
+extern int select_fast_op(chan_t *chan, int cd, int op_type, any_t *data);
+
+#endif
@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "selgroup.h"
+#include "chpool.h"
+#include "cb.h"
+
+/*
+ * `struct selgroup` is a select group. 'ready' is the FIFO list of the watches that
+ * may be ready, of length 'nready'; 'watches' is the list of all of them. Both are
+ * protected by 'mutex', and 'cond' is signaled when a watch is queued.
+ */
+struct selgroup {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    sg_watch_t     *ready_head;
+    sg_watch_t     *ready_tail;
+    size_t          nready;
+    sg_watch_t     *watches;
+};
+
+/*
+ * Function: ready_push
+ * --------------------
+ * Appends a watch to the ready list of its group, unless it is already there.
+ * Called with the group locked.
+ */
+static void ready_push(sg_watch_t *w) {
+    selgroup_t *g = w->group;
+
+    if (w->queued)
+        return;
+    w->queued = 1;
+    w->ready_next = NULL;
+    if (g->ready_tail)
+        g->ready_tail->ready_next = w;
+    else
+        g->ready_head = w;
+    g->ready_tail = w;
+    g->nready++;
+    pthread_cond_signal(&(g->cond));
+}
+
+/*
+ * Function: ready_pop
+ * -------------------
+ * Removes the first watch of the ready list. Called with the group locked.
+ */
+static sg_watch_t *ready_pop(selgroup_t *g) {
+    sg_watch_t *w = g->ready_head;
+
+    if (w) {
+        g->ready_head = w->ready_next;
+        if (!g->ready_head)
+            g->ready_tail = NULL;
+        g->nready--;
+        w->queued = 0;
+    }
+    return w;
+}
+
+/*
+ * Function: ready_remove
+ * ----------------------
+ * Removes a watch from the ready list, wherever it is. Called with the group locked.
+ */
+static void ready_remove(sg_watch_t *w) {
+    selgroup_t *g = w->group;
+    sg_watch_t **pp;
+    sg_watch_t *prev = NULL;
+
+    if (!w->queued)
+        return;
+    for (pp = &(g->ready_head); *pp != w; pp = &((*pp)->ready_next))
+        prev = *pp;
+    *pp = w->ready_next;
+    if (g->ready_tail == w)
+        g->ready_tail = prev;
+    g->nready--;
+    w->queued = 0;
+}
+
+/*
+ * Function: watch_ready
+ * ---------------------
+ * Tells whether the operation of a watch could complete now. The lengths are read
+ * without the channel lock, so this is a hint the caller confirms by trying the
+ * operation. Called with the group locked, which keeps 'chan' alive.
+ */
+static int watch_ready(sg_watch_t *w) {
+    if (w->op_type == OP_RECV)
+        return cb_can_read(w->chan->cb);
+    return cb_can_write(w->chan->cb);
+}
+
+/*
+ * Function: watch_unlink
+ * ----------------------
+ * Removes a watch from its group and frees it. Called with the group locked, and
+ * after the watch was detached from its channel.
+ */
+static void watch_unlink(sg_watch_t *w) {
+    selgroup_t *g = w->group;
+
+    ready_remove(w);
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        g->watches = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    free(w);
+}
+
+/*
+ * Function: chan_unwatch
+ * ----------------------
+ * Removes a watch from the list of its channel. Called with the channel locked.
+ */
+static void chan_unwatch(chan_t *chan, sg_watch_t *w) {
+    sg_watch_t **pp;
+
+    for (pp = &(chan->watches); *pp; pp = &((*pp)->chan_next)) {
+        if (*pp == w) {
+            *pp = w->chan_next;
+            break;
+        }
+    }
+}
+
+void selgroup_notify(chan_t *chan, int readable, int writable) {
+    sg_watch_t *w;
+
+    for (w = chan->watches; w; w = w->chan_next) {
+        if (w->op_type == OP_RECV ? !readable : !writable)
+            continue;
+        pthread_mutex_lock(&(w->group->mutex));
+        ready_push(w);
+        pthread_mutex_unlock(&(w->group->mutex));
+    }
+}
+
+void selgroup_detach(chan_t *chan) {
+    sg_watch_t *w;
+
+    while ((w = chan->watches) != NULL) {
+        chan->watches = w->chan_next;
+        pthread_mutex_lock(&(w->group->mutex));
+        w->chan = NULL;
+        w->chan_next = NULL;
+        ready_push(w);
+        pthread_mutex_unlock(&(w->group->mutex));
+    }
+}
+
+/*
+ * Function: selgroup_create
+ * -------------------------
+ * Creates an empty select group. Returns NULL if memory runs out.
+ */
+selgroup_t *selgroup_create(void) {
+    selgroup_t *g = calloc(1, sizeof(selgroup_t));
+    pthread_condattr_t attr;
+
+    if (!g)
+        return NULL;
+    pthread_mutex_init(&(g->mutex), NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(g->cond), &attr);
+    pthread_condattr_destroy(&attr);
+    return g;
+}
+
+/*
+ * Function: selgroup_add
+ * ----------------------
+ * Registers an operation on a channel in a select group. The watch is queued at once
+ * if the operation can already complete. Returns 0 on success, -1 if the channel does
+ * not exist, does not support readiness notifications, or memory runs out.
+ */
+int selgroup_add(selgroup_t *g, int cd, int op_type) {
+    chan_t *chan = get_channel_from_table(cd);
+    sg_watch_t *w;
+
+    if (!g || !chan || !chan->cb || cb_lockfree(chan->cb) || (op_type != OP_SEND && op_type != OP_RECV))
+        return -1;
+    if (!(w = calloc(1, sizeof(sg_watch_t))))
+        return -1;
+    w->group = g;
+    w->chan = chan;
+    w->cd = cd;
+    w->op_type = op_type;
+
+    chlock_lock(&(chan->lock));
+    pthread_mutex_lock(&(g->mutex));
+    w->chan_next = chan->watches;
+    chan->watches = w;
+    w->next = g->watches;
+    if (g->watches)
+        g->watches->prev = w;
+    g->watches = w;
+    if (watch_ready(w))
+        ready_push(w);
+    pthread_mutex_unlock(&(g->mutex));
+    chlock_unlock(&(chan->lock));
+    return 0;
+}
+
+/*
+ * Function: selgroup_del
+ * ----------------------
+ * Withdraws an operation on a channel from a select group. Returns 0 on success, -1
+ * if it was not registered.
+ */
+int selgroup_del(selgroup_t *g, int cd, int op_type) {
+    chan_t *chan = get_channel_from_table(cd);
+    sg_watch_t *w;
+
+    if (!g)
+        return -1;
+    if (chan)
+        chlock_lock(&(chan->lock));
+    pthread_mutex_lock(&(g->mutex));
+    for (w = g->watches; w; w = w->next)
+        if (w->cd == cd && w->op_type == op_type)
+            break;
+    if (w) {
+        if (w->chan)
+            chan_unwatch(w->chan, w);
+        watch_unlink(w);
+    }
+    pthread_mutex_unlock(&(g->mutex));
+    if (chan)
+        chlock_unlock(&(chan->lock));
+    return w ? 0 : -1;
+}
+
+/*
+ * Function: selgroup_collect
+ * --------------------------
+ * Moves up to 'max' events out of the ready list of a group. Every watch queued when
+ * it starts is looked at once: a watch whose operation can complete is reported and
+ * queued again at the tail (readiness is level-triggered), one of a closed channel is
+ * reported and dropped, and any other leaves the list until its channel notifies it.
+ * Called with the group locked.
+ */
+static size_t selgroup_collect(selgroup_t *g, selgroup_event_t *events, size_t max) {
+    size_t todo = g->nready;
+    size_t n = 0;
+    sg_watch_t *w;
+
+    while (todo-- > 0 && n < max && (w = ready_pop(g)) != NULL) {
+        if (!w->chan) {
+            events[n].cd = w->cd;
+            events[n].op_type = w->op_type;
+            events[n].closed = 1;
+            n++;
+            watch_unlink(w);
+        } else if (watch_ready(w)) {
+            events[n].cd = w->cd;
+            events[n].op_type = w->op_type;
+            events[n].closed = 0;
+            n++;
+            ready_push(w);
+        }
+    }
+    return n;
+}
+
+/*
+ * Function: selgroup_wait
+ * -----------------------
+ * Waits until operations registered in a select group can complete, for at most
+ * 'timeout' milliseconds (-1 waits forever, 0 does not wait), and stores up to 'max'
+ * of them in 'events'. Returns the number of events stored, 0 on timeout, or -1 if
+ * the arguments are invalid.
+ */
+int selgroup_wait(selgroup_t *g, selgroup_event_t *events, size_t max, int timeout) {
+    struct timespec deadline;
+    size_t n;
+    int rc = 0;
+
+    if (!g || !events || max == 0)
+        return -1;
+    if (timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&(g->mutex));
+    while ((n = selgroup_collect(g, events, max)) == 0 && timeout != 0 && rc != ETIMEDOUT) {
+        if (timeout < 0)
+            pthread_cond_wait(&(g->cond), &(g->mutex));
+        else
+            rc = pthread_cond_timedwait(&(g->cond), &(g->mutex), &deadline);
+    }
+    pthread_mutex_unlock(&(g->mutex));
+    return (int)n;
+}
+
+/*
+ * Function: selgroup_free
+ * -----------------------
+ * Withdraws every registration of a select group and frees it. No thread may be
+ * using the group.
+ */
+void selgroup_free(selgroup_t *g) {
+    sg_watch_t *w;
+    chan_t *chan;
+    int cd;
+
+    if (!g)
+        return;
+    pthread_mutex_lock(&(g->mutex));
+    while ((w = g->watches) != NULL) {
+        if (w->chan) {
+            // Take the locks in the channel -> group order. The watch cannot go away
+            // meanwhile: only the owner of the group frees watches.
+            cd = w->cd;
+            pthread_mutex_unlock(&(g->mutex));
+            chan = get_channel_from_table(cd);
+            if (chan)
+                chlock_lock(&(chan->lock));
+            pthread_mutex_lock(&(g->mutex));
+            if (w->chan)
+                chan_unwatch(w->chan, w);
+            watch_unlink(w);
+            pthread_mutex_unlock(&(g->mutex));
+            if (chan)
+                chlock_unlock(&(chan->lock));
+            pthread_mutex_lock(&(g->mutex));
+        } else {
+            watch_unlink(w);
+        }
+    }
+    pthread_mutex_unlock(&(g->mutex));
+
+    pthread_cond_destroy(&(g->cond));
+    pthread_mutex_destroy(&(g->mutex));
+    free(g);
+}
@@ -0,0 +1,66 @@
+/*
+ * File: selgroup.h
+ * ----------------------------
+ * This header file includes the internal interface of select groups.
+ *
+ * A select group keeps a watch per registered (channel, operation) pair. Each
+ * channel keeps the list of the watches on it, and pushes a watch to the ready
+ * list of its group when the operation becomes possible, from the same transition
+ * points that drive the readiness eventfds (see chan_notify in chan.c). Waiting on
+ * a group then only looks at the watches that became ready.
+ *
+ * Functions:
+ * selgroup_notify: Queues the watches of a channel whose operation became possible.
+ * selgroup_detach: Hands the watches of a channel being closed back to their groups.
+ */
+#ifndef _LC_SELGROUP_H
+#define _LC_SELGROUP_H 1
+
+#include "libchannel.h"
+#include "chan.h"
+
+/*
+ * `sg_watch_t` is the registration of an operation on a channel in a select group.
+ * 'chan' and 'chan_next' are protected by the channel lock, and also by the group
+ * lock when they change, so that the group can tell a closed channel by 'chan'
+ * being NULL. The other fields are protected by the group lock.
+ */
+typedef struct sg_watch {
+    selgroup_t      *group;
+    chan_t          *chan;
+    int              cd;
+    int              op_type;
+    int              queued;
+    struct sg_watch *chan_next;
+    struct sg_watch *ready_next;
+    struct sg_watch *next;
+    struct sg_watch *prev;
+} sg_watch_t;
+
+/*
+ * Function: selgroup_notify
+ * -------------------------
+ * Pushes the watches of a channel to the ready lists of their groups, and wakes the
+ * groups, for the operations that just became possible. Must be called with the
+ * channel locked.
+ *
+ * Parameters:
+ *    chan - the channel.
+ *    readable - whether a receive became possible.
+ *    writable - whether a send became possible.
+ */
+extern void selgroup_notify(chan_t *chan, int readable, int writable);
+
+/*
+ * Function: selgroup_detach
+ * -------------------------
+ * Detaches every watch from a channel that is being closed. The watches stay in
+ * their groups, marked closed and ready, so that the next wait reports the channel
+ * as closed. Must be called with the channel locked.
+ *
+ * Parameters:
+ *    chan - the channel.
+ */
+extern void selgroup_detach(chan_t *chan);
+
+#endif
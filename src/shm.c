@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "libchannel.h"
+
+/*
+ * Constants: segment header
+ * -------------------------
+ * SHM_CHAN_MAGIC is stored last by the creator, once the segment is initialized.
+ * Openers wait for it (at most SHM_OPEN_TRIES times SHM_OPEN_DELAY_US).
+ */
+#define SHM_CHAN_MAGIC     0x6c636873u  /* "lchs" */
+#define SHM_CHAN_VERSION   1
+#define SHM_OPEN_TRIES     1000
+#define SHM_OPEN_DELAY_US  1000
+#define SHM_CACHE_LINE     64
+
+/*
+ * `shm_hdr_t` is the header at the start of a shared memory segment, followed by the
+ * ring of 'cap' slots of 'stride' bytes. 'head' and 'tail' only grow, so the state is
+ * consistent at every store: a process that dies in the middle of an operation leaves
+ * either the old or the new state behind, and the robust mutex hands the lock over.
+ *
+ * 'recv_seq' and 'send_seq' are futex words bumped when a send (resp. receive) finds
+ * parked receivers (resp. senders). The '*_waiters' counters let the fast path skip
+ * the futex wake syscall when nobody is parked.
+ */
+typedef struct {
+    atomic_uint     magic;
+    uint32_t        version;
+    size_t          cap;
+    size_t          elem_size;
+    size_t          stride;
+    size_t          data_offset;
+    pthread_mutex_t mutex;          // PTHREAD_PROCESS_SHARED, PTHREAD_MUTEX_ROBUST
+    size_t          head;           // Next slot to read
+    size_t          tail;           // Next slot to write
+    atomic_uint     recv_seq;
+    atomic_uint     send_seq;
+    atomic_uint     recv_waiters;
+    atomic_uint     send_waiters;
+} shm_hdr_t;
+
+struct shm_chan {
+    shm_hdr_t *hdr;
+    char      *data;
+    size_t     size;                // Size of the mapping
+};
+
+static long futex(atomic_uint *word, int op, unsigned int val) {
+    return syscall(SYS_futex, (unsigned int *)word, op, val, NULL, NULL, 0);
+}
+
+/*
+ * Function: shm_lock
+ * ------------------
+ * Locks the segment mutex. If its previous owner died while holding it, the mutex is
+ * marked consistent again: the ring state never needs repairing (see shm_hdr_t).
+ */
+static int shm_lock(shm_hdr_t *hdr) {
+    int ret = pthread_mutex_lock(&(hdr->mutex));
+    if (ret == EOWNERDEAD)
+        ret = pthread_mutex_consistent(&(hdr->mutex));
+    return ret;
+}
+
+static size_t shm_segment_size(size_t len, size_t stride) {
+    size_t data_offset = (sizeof(shm_hdr_t) + SHM_CACHE_LINE - 1) & ~(size_t)(SHM_CACHE_LINE - 1);
+    return data_offset + len * stride;
+}
+
+static shm_chan_t *shm_map(int fd, size_t size) {
+    shm_chan_t *ch;
+    void *addr;
+
+    if (!(ch = calloc(1, sizeof(shm_chan_t))))
+        return NULL;
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        free(ch);
+        return NULL;
+    }
+    ch->hdr = addr;
+    ch->size = size;
+    return ch;
+}
+
+/*
+ * Function: make_chan_shm
+ * -----------------------
+ * Creates a channel of 'len' elements of 'elem_size' bytes in the POSIX shared memory
+ * object 'name' (as for shm_open, e.g. "/mychan"). Fails if the object already exists.
+ * Returns a handle, or NULL with errno set.
+ */
+shm_chan_t *make_chan_shm(const char *name, size_t len, size_t elem_size) {
+    pthread_mutexattr_t attr;
+    shm_chan_t *ch;
+    shm_hdr_t  *hdr;
+    size_t stride;
+    size_t size;
+    int fd;
+
+    if (!name || len == 0 || elem_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    stride = (elem_size + 7) & ~(size_t)7;
+    size = shm_segment_size(len, stride);
+
+    if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600)) < 0)
+        return NULL;
+    if (ftruncate(fd, size) != 0 || !(ch = shm_map(fd, size))) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    close(fd);
+
+    hdr = ch->hdr;
+    hdr->version = SHM_CHAN_VERSION;
+    hdr->cap = len;
+    hdr->elem_size = elem_size;
+    hdr->stride = stride;
+    hdr->data_offset = size - len * stride;
+    hdr->head = 0;
+    hdr->tail = 0;
+    atomic_init(&(hdr->recv_seq), 0);
+    atomic_init(&(hdr->send_seq), 0);
+    atomic_init(&(hdr->recv_waiters), 0);
+    atomic_init(&(hdr->send_waiters), 0);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&(hdr->mutex), &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    ch->data = (char *)hdr + hdr->data_offset;
+    atomic_store_explicit(&(hdr->magic), SHM_CHAN_MAGIC, memory_order_release);
+    return ch;
+}
+
+/*
+ * Function: open_chan_shm
+ * -----------------------
+ * Opens a channel created by make_chan_shm, possibly in another process. Waits a
+ * short while for the creator to finish initializing it.
+ * Returns a handle, or NULL with errno set.
+ */
+shm_chan_t *open_chan_shm(const char *name) {
+    struct stat st;
+    shm_chan_t *ch;
+    int tries;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDWR, 0600)) < 0)
+        return NULL;
+    for (tries = 0; ; tries++) {
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return NULL;
+        }
+        if (st.st_size >= (off_t)sizeof(shm_hdr_t))
+            break;
+        if (tries == SHM_OPEN_TRIES) {
+            close(fd);
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+        usleep(SHM_OPEN_DELAY_US);
+    }
+    ch = shm_map(fd, st.st_size);
+    close(fd);
+    if (!ch)
+        return NULL;
+
+    for (tries = 0; atomic_load_explicit(&(ch->hdr->magic), memory_order_acquire) != SHM_CHAN_MAGIC; tries++) {
+        if (tries == SHM_OPEN_TRIES) {
+            close_chan_shm(ch);
+            errno = ETIMEDOUT;
+            return NULL;
+        }
+        usleep(SHM_OPEN_DELAY_US);
+    }
+    if (ch->hdr->version != SHM_CHAN_VERSION ||
+        shm_segment_size(ch->hdr->cap, ch->hdr->stride) > ch->size) {
+        close_chan_shm(ch);
+        errno = EINVAL;
+        return NULL;
+    }
+    ch->data = (char *)ch->hdr + ch->hdr->data_offset;
+    return ch;
+}
+
+/*
+ * Function: close_chan_shm
+ * ------------------------
+ * Unmaps the channel from the calling process. The shared memory object itself
+ * lives until unlink_chan_shm is called and every process closed it.
+ */
+void close_chan_shm(shm_chan_t *ch) {
+    if (ch) {
+        munmap(ch->hdr, ch->size);
+        free(ch);
+    }
+}
+
+/*
+ * Function: unlink_chan_shm
+ * -------------------------
+ * Removes the name of a shared memory channel. Returns 0 on success, -1 with errno set.
+ */
+int unlink_chan_shm(const char *name) {
+    return shm_unlink(name);
+}
+
+/*
+ * Function: shm_transfer
+ * ----------------------
+ * Common body of send_chan_shm and recv_chan_shm. Under the segment mutex, it copies
+ * one element in or out if the ring allows it, and bumps the futex word of the other
+ * side if processes are parked on it. Otherwise it registers as a waiter and parks on
+ * its own futex word, or fails with EAGAIN when should_block is false.
+ */
+static int shm_transfer(shm_chan_t *ch, void *elem, int op_type, int should_block) {
+    shm_hdr_t   *hdr = ch->hdr;
+    atomic_uint *my_seq      = op_type == OP_SEND ? &(hdr->send_seq) : &(hdr->recv_seq);
+    atomic_uint *my_waiters  = op_type == OP_SEND ? &(hdr->send_waiters) : &(hdr->recv_waiters);
+    atomic_uint *peer_seq    = op_type == OP_SEND ? &(hdr->recv_seq) : &(hdr->send_seq);
+    atomic_uint *peer_waiters = op_type == OP_SEND ? &(hdr->recv_waiters) : &(hdr->send_waiters);
+    unsigned int seq;
+    int wake;
+    int ret;
+    char *slot;
+
+    for (;;) {
+        // shm_lock already recovered a dead owner: report what actually failed
+        if ((ret = shm_lock(hdr)) != 0) {
+            errno = ret;
+            return -1;
+        }
+        if (op_type == OP_SEND ? hdr->tail - hdr->head < hdr->cap : hdr->tail != hdr->head)
+            break;
+        if (!should_block) {
+            pthread_mutex_unlock(&(hdr->mutex));
+            errno = EAGAIN;
+            return -1;
+        }
+        atomic_fetch_add(my_waiters, 1);
+        seq = atomic_load(my_seq);
+        pthread_mutex_unlock(&(hdr->mutex));
+        futex(my_seq, FUTEX_WAIT, seq);
+        atomic_fetch_sub(my_waiters, 1);
+    }
+
+    if (op_type == OP_SEND) {
+        slot = ch->data + (hdr->tail % hdr->cap) * hdr->stride;
+        memcpy(slot, elem, hdr->elem_size);
+        hdr->tail++;
+    } else {
+        slot = ch->data + (hdr->head % hdr->cap) * hdr->stride;
+        memcpy(elem, slot, hdr->elem_size);
+        hdr->head++;
+    }
+    if ((wake = atomic_load(peer_waiters) > 0))
+        atomic_fetch_add(peer_seq, 1);
+    pthread_mutex_unlock(&(hdr->mutex));
+
+    if (wake)
+        futex(peer_seq, FUTEX_WAKE, 1);
+    return 0;
+}
+
+/*
+ * Function: send_chan_shm / recv_chan_shm
+ * ---------------------------------------
+ * Copy elem_size bytes into (resp. out of) a shared memory channel. With should_block
+ * set, wait for space (resp. data), parking on a process-shared futex. Uncontended
+ * operations make no system call. Return 0 on success, -1 with errno set (EAGAIN if
+ * the operation would block).
+ */
+int send_chan_shm(shm_chan_t *ch, const void *elem, int should_block) {
+    return shm_transfer(ch, (void *)elem, OP_SEND, should_block);
+}
+
+int recv_chan_shm(shm_chan_t *ch, void *elem, int should_block) {
+    return shm_transfer(ch, elem, OP_RECV, should_block);
+}
+
+/*
+ * Function: len_chan_shm
+ * ----------------------
+ * Returns the number of elements buffered in a shared memory channel.
+ */
+size_t len_chan_shm(shm_chan_t *ch) {
+    size_t n = 0;
+    if (shm_lock(ch->hdr) == 0) {
+        n = ch->hdr->tail - ch->hdr->head;
+        pthread_mutex_unlock(&(ch->hdr->mutex));
+    }
+    return n;
+}
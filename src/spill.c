@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "spill.h"
+
+/*
+ * Constant: SPILL_RECLAIM_SLOTS
+ * -----------------------------
+ * A drained segment punches the blocks it used out of its file once more than
+ * this many slots were touched. Smaller bursts keep their blocks, so a channel
+ * hovering around full does not pay a system call per message.
+ */
+#define SPILL_RECLAIM_SLOTS (1 << 16)
+
+/*
+ * Function: spill_tmpfile
+ * -----------------------
+ * Opens an unnamed file in 'dir': with O_TMPFILE where the file system supports
+ * it, otherwise with mkstemp followed by unlink.
+ */
+static int spill_tmpfile(const char *dir) {
+    char path[4096];
+    int fd;
+
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+        return fd;
+
+    if (snprintf(path, sizeof(path), "%s/libchannel-spill-XXXXXX", dir) >= (int)sizeof(path))
+        return -1;
+    if ((fd = mkostemp(path, O_CLOEXEC)) >= 0)
+        unlink(path);
+    return fd;
+}
+
+spill_t *spill_open(const char *dir, size_t max_bytes) {
+    spill_t *sp;
+    size_t cap = max_bytes / sizeof(any_t);
+
+    if (!dir || cap == 0)
+        return NULL;
+    if (!(sp = calloc(1, sizeof(spill_t))))
+        return NULL;
+    if ((sp->fd = spill_tmpfile(dir)) < 0) {
+        free(sp);
+        return NULL;
+    }
+    // The file is sparse: blocks are only allocated for the slots written
+    if (ftruncate(sp->fd, cap * sizeof(any_t)) != 0)
+        goto fail;
+    sp->slots = mmap(NULL, cap * sizeof(any_t), PROT_READ | PROT_WRITE, MAP_SHARED, sp->fd, 0);
+    if (sp->slots == MAP_FAILED)
+        goto fail;
+    sp->cap = cap;
+    return sp;
+
+fail:
+    close(sp->fd);
+    free(sp);
+    return NULL;
+}
+
+void spill_close(spill_t **sp) {
+    if (sp && *sp) {
+        munmap((*sp)->slots, (*sp)->cap * sizeof(any_t));
+        close((*sp)->fd);
+        free(*sp);
+        *sp = NULL;
+    }
+}
+
+int spill_write(spill_t *sp, any_t data) {
+    if (sp->len == sp->cap)
+        return 0;
+    sp->slots[sp->end] = data;
+    sp->end = (sp->end + 1) % sp->cap;
+    sp->len++;
+    if (sp->used < sp->cap)
+        sp->used++;
+    return 1;
+}
+
+int spill_read(spill_t *sp, any_t *data) {
+    if (sp->len == 0)
+        return 0;
+    *data = sp->slots[sp->start];
+    sp->start = (sp->start + 1) % sp->cap;
+    if (--sp->len == 0) {
+        // Restart from the beginning of the file, and free its blocks after a large burst
+        if (sp->used > SPILL_RECLAIM_SLOTS) {
+            fallocate(sp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, sp->cap * sizeof(any_t));
+            sp->used = 0;
+        }
+        sp->start = 0;
+        sp->end = 0;
+    }
+    return 1;
+}
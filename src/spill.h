@@ -0,0 +1,73 @@
+/*
+ * File: spill.h
+ * ----------------------------
+ * This header file includes the internal interface of spill segments.
+ *
+ * A spill segment is a FIFO of `any_t` values kept in a memory mapped, unnamed
+ * file. It backs the overflow of a channel buffer created by make_chan_spill:
+ * writes and reads are plain memory copies into the page cache, and the kernel
+ * writes the pages back to disk when memory gets tight.
+ *
+ * Functions:
+ * spill_open: Creates a spill segment of at most a given number of bytes.
+ * spill_close: Unmaps and closes a spill segment.
+ * spill_write: Appends a value to a spill segment.
+ * spill_read: Removes the oldest value of a spill segment.
+ */
+#ifndef _LC_SPILL_H
+#define _LC_SPILL_H 1
+
+#include <stddef.h>
+#include "libchannel.h"
+
+typedef struct {
+    int    fd;
+    any_t *slots;       // Mapping of the file
+    size_t cap;         // Number of slots of the file
+    size_t start;
+    size_t end;
+    size_t len;
+    size_t used;        // Slots touched since the file was last reclaimed
+} spill_t;
+
+/*
+ * Function: spill_open
+ * --------------------
+ * Creates an unnamed file in the directory 'dir' and maps it as a spill segment
+ * of max_bytes / sizeof(any_t) values. The file never appears in the directory
+ * and its blocks are freed when the segment is closed.
+ *
+ * Returns: a pointer to the segment, or NULL on failure.
+ */
+extern spill_t *spill_open(const char *dir, size_t max_bytes);
+
+/*
+ * Function: spill_close
+ * ---------------------
+ * Unmaps and closes the spill segment pointed by its argument, and sets the
+ * pointer to NULL.
+ */
+extern void spill_close(spill_t **sp);
+
+/*
+ * Function: spill_write
+ * ---------------------
+ * Appends a value to the segment.
+ *
+ * Returns: 1 on success, 0 if the segment is full.
+ */
+extern int spill_write(spill_t *sp, any_t data);
+
+/*
+ * Function: spill_read
+ * --------------------
+ * Removes the oldest value of the segment. When the segment becomes empty, it
+ * starts over at the beginning of its file. Its disk blocks are given back to the
+ * file system only if more than SPILL_RECLAIM_SLOTS slots were written since the
+ * last time (see spill.c), which a segment of fewer slots never reaches.
+ *
+ * Returns: 1 on success, 0 if the segment is empty.
+ */
+extern int spill_read(spill_t *sp, any_t *data);
+
+#endif
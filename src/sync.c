@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "libchannel.h"
+#include "chan.h"
+#include "chpool.h"
+#include "cvpool.h"
+#include "select.h"
+
+/*
+ * The synchronization primitives are channels whose buffer is a bare counter (see
+ * CB_COUNTER, CB_WAITGROUP and CB_BARRIER in cb.h), so select_chan can wait on them
+ * like on any other channel. Outside of a select, semaphores and wait groups update
+ * their counter with atomic operations and only take the channel lock when the wait
+ * queue on the other side is not empty.
+ *
+ * The lock-free updates pair with select_enqueue_locked: an updater changes the
+ * counter, then reads the length of the wait queue; a waiter enqueues itself, then
+ * reads the counter again. With a full fence on both sides, at least one of them
+ * sees the other, so a wakeup is never lost.
+ */
+
+static chan_t *sync_chan(int cd, int kind) {
+    chan_t *chan = get_channel_from_table(cd);
+    if (!chan || !chan->cb || chan->cb->kind != kind)
+        return NULL;
+    return chan;
+}
+
+/*
+ * Function: wake_if_waiting
+ * -------------------------
+ * After a lock-free update of the counter, wake the waiters of 'waitq' if there are
+ * any: the next one for the opposite of op_type, or all of them if 'all' is set.
+ */
+static void wake_if_waiting(chan_t *chan, int cd, waitq_t *waitq, int op_type, int all) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (__atomic_load_n(&(waitq->len), __ATOMIC_SEQ_CST) == 0)
+        return;
+    chlock_lock(&(chan->lock));
+    if (all)
+        wakeup_all_waiting(chan, cd);
+    else
+        wakeup_next_waiting(chan, op_type, cd);
+    chlock_unlock(&(chan->lock));
+    run_deferred();
+}
+
+/*
+ * Function: make_sem
+ * ------------------
+ * Creates a counting semaphore holding 'initial' units, and at most 'max'.
+ * Returns its descriptor, or -1 on failure.
+ */
+sem_chan_t make_sem(size_t initial, size_t max) {
+    if (max == 0 || initial > max)
+        return -1;
+    return add_chan(cb_init_sync(CB_COUNTER, initial, max), 0);
+}
+
+/*
+ * Function: sem_acquire / sem_try_acquire / sem_release
+ * -----------------------------------------------------
+ * Take a unit of a semaphore, blocking while it has none (sem_acquire) or failing
+ * (sem_try_acquire); give a unit back, blocking while the semaphore is at its
+ * maximum. Return the descriptor on success, 0 if sem_try_acquire found no unit,
+ * and a negative value if the semaphore does not exist.
+ */
+int sem_acquire(sem_chan_t sem) {
+    chan_t *chan = sync_chan(sem, CB_COUNTER);
+    any_t token;
+
+    if (!chan)
+        return -1;
+    if (select_fast_op(chan, sem, OP_RECV, &token))
+        return sem;
+    return recv_chan(sem, &token);
+}
+
+int sem_try_acquire(sem_chan_t sem) {
+    chan_t *chan = sync_chan(sem, CB_COUNTER);
+    any_t token;
+
+    if (!chan)
+        return -1;
+    if (select_fast_op(chan, sem, OP_RECV, &token))
+        return sem;
+    return recv_chan_bctrl(sem, &token, SELECT_NONBLOCK);
+}
+
+int sem_release(sem_chan_t sem) {
+    chan_t *chan = sync_chan(sem, CB_COUNTER);
+    any_t token = { VAR_INT32, { 0 } };
+
+    if (!chan)
+        return -1;
+    if (select_fast_op(chan, sem, OP_SEND, &token))
+        return sem;
+    return send_chan(sem, &token);
+}
+
+/*
+ * Function: make_waitgroup
+ * ------------------------
+ * Creates a wait group with a counter of 0. Returns its descriptor, or -1 on failure.
+ */
+waitgroup_t make_waitgroup(void) {
+    return add_chan(cb_init_sync(CB_WAITGROUP, 0, SIZE_MAX), 0);
+}
+
+/*
+ * Function: wg_add / wg_done
+ * --------------------------
+ * Add delta (wg_done: -1) to the counter of a wait group. When it drops to 0, every
+ * waiter is woken in a single pass. Return 0 on success, -1 if the wait group does
+ * not exist or the counter would become negative.
+ */
+int wg_add(waitgroup_t wg, int delta) {
+    chan_t *chan = sync_chan(wg, CB_WAITGROUP);
+
+    if (!chan || !counter_add(chan->cb, delta))
+        return -1;
+    if (delta < 0 && __atomic_load_n(&(chan->cb->len), __ATOMIC_SEQ_CST) == 0)
+        wake_if_waiting(chan, wg, &(chan->recvq), OP_SEND, 1);
+    return 0;
+}
+
+int wg_done(waitgroup_t wg) {
+    return wg_add(wg, -1);
+}
+
+/*
+ * Function: wg_wait
+ * -----------------
+ * Blocks until the counter of a wait group is 0. Returns the descriptor, or a
+ * negative value if the wait group does not exist.
+ */
+int wg_wait(waitgroup_t wg) {
+    chan_t *chan = sync_chan(wg, CB_WAITGROUP);
+    any_t token;
+
+    if (!chan)
+        return -1;
+    if (__atomic_load_n(&(chan->cb->len), __ATOMIC_SEQ_CST) == 0)
+        return wg;
+    return recv_chan(wg, &token);
+}
+
+/*
+ * Function: make_barrier
+ * ----------------------
+ * Creates a barrier for 'parties' threads. Returns its descriptor, or -1 on failure.
+ */
+barrier_t make_barrier(size_t parties) {
+    if (parties == 0)
+        return -1;
+    return add_chan(cb_init_sync(CB_BARRIER, 0, parties), 0);
+}
+
+/*
+ * Function: barrier_wait
+ * ----------------------
+ * Arrives at a barrier and blocks until all its parties arrived. The last one to
+ * arrive starts the next generation and wakes the others in a single pass.
+ *
+ * Returns: 1 for the last party to arrive, 0 for the others, and a negative value
+ * if the barrier does not exist.
+ */
+int barrier_wait(barrier_t barrier) {
+    chan_t *chan = sync_chan(barrier, CB_BARRIER);
+    any_t token;
+    int ret;
+
+    if (!chan)
+        return -1;
+
+    chlock_lock(&(chan->lock));
+    select_set_t op[] = {
+        {barrier, OP_RECV, NULL, &token, chan->cb->seq},  // Wait for the next generation
+    };
+    // len() reads the count of arrived parties without the lock
+    if (__atomic_add_fetch(&(chan->cb->len), 1, __ATOMIC_RELAXED) == chan->cb->cap) {
+        __atomic_store_n(&(chan->cb->len), 0, __ATOMIC_RELAXED);
+        chan->cb->seq++;
+        wakeup_all_waiting(chan, barrier);
+        chlock_unlock(&(chan->lock));
+        run_deferred();
+        return 1;
+    }
+    chlock_unlock(&(chan->lock));
+
+    ret = select_chan(op, 1, SELECT_BLOCK);
+    return ret == barrier ? 0 : ret;
+}
@@ -0,0 +1,587 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "libchannel.h"
+#include "atomic.h"
+#include "task.h"
+
+/*
+ * Constants: stack sizes
+ * ----------------------
+ * Every task runs on its own mmap'd stack, with a guard page below it. Finished tasks
+ * are recycled; up to TASK_STACK_CACHE of them keep their stack for the next go_task.
+ */
+#define TASK_STACK_SIZE  (64 * 1024)
+#define TASK_STACK_CACHE 1024
+
+/*
+ * Constants: task states
+ * ----------------------
+ * TASK_RUNNING:  the task is runnable or running.
+ * TASK_PARKED:   the task is parked and waits for task_wake.
+ * TASK_NOTIFIED: task_wake was called before the task finished parking.
+ * TASK_DEAD:     the task returned and sits in the free list.
+ */
+#define TASK_RUNNING  0
+#define TASK_PARKED   1
+#define TASK_NOTIFIED 2
+#define TASK_DEAD     3
+
+/*
+ * Constants: switch actions
+ * -------------------------
+ * What the worker does with a task once it switches back to the scheduler.
+ */
+#define ACTION_YIELD 0
+#define ACTION_PARK  1
+#define ACTION_EXIT  2
+
+/*
+ * Context switch
+ * --------------
+ * A task switch happens on every park, yield and wakeup, so on x86-64 it is a few
+ * instructions of assembly that only save and restore what the calling convention
+ * asks a callee to preserve: the callee-saved registers, the SSE and x87 control
+ * words, and the stack pointer. swapcontext also saves the signal mask, which costs
+ * an rt_sigprocmask system call per switch; tasks do not have signal masks of their
+ * own and run with the mask of the worker thread they are on. Other architectures
+ * fall back to ucontext.
+ *
+ * ctx_switch(from, to) saves the running context in 'from' and resumes 'to'. It
+ * returns when something switches back to 'from'.
+ */
+#if defined(__x86_64__)
+
+typedef struct {
+    void *sp;                  // Saved stack pointer, the registers are below it
+} task_ctx_t;
+
+extern void lc_ctx_switch(void **from_sp, void *to_sp);
+
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    ".type lc_ctx_switch, @function\n"
+    "lc_ctx_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size lc_ctx_switch, .-lc_ctx_switch\n"
+);
+
+static void ctx_switch(task_ctx_t *from, task_ctx_t *to) {
+    lc_ctx_switch(&(from->sp), to->sp);
+}
+
+/*
+ * Function: ctx_make
+ * ------------------
+ * Prepares a context that runs 'entry' on the given stack the first time it is
+ * switched to: the frame lc_ctx_switch pops, returning into 'entry' as if 'entry'
+ * had been called, with the default control words. 'entry' must not return.
+ */
+static void ctx_make(task_ctx_t *ctx, char *stack, size_t size, void (*entry)(void)) {
+    uintptr_t top = ((uintptr_t)(stack + size)) & ~(uintptr_t)15;
+    uint64_t *sp = (uint64_t *)top;
+
+    *--sp = 0;                      // Return address of 'entry', never used
+    *--sp = (uintptr_t)entry;       // Where lc_ctx_switch returns
+    sp -= 6;                        // rbp, rbx, r12-r15
+    memset(sp, 0, 6 * sizeof(uint64_t));
+    *--sp = 0x1f80 | (uint64_t)0x037f << 32;  // MXCSR and x87 control word
+    ctx->sp = sp;
+}
+
+#else
+
+#include <ucontext.h>
+
+typedef ucontext_t task_ctx_t;
+
+static void ctx_switch(task_ctx_t *from, task_ctx_t *to) {
+    swapcontext(from, to);
+}
+
+static void ctx_make(task_ctx_t *ctx, char *stack, size_t size, void (*entry)(void)) {
+    getcontext(ctx);
+    ctx->uc_stack.ss_sp = stack;
+    ctx->uc_stack.ss_size = size;
+    ctx->uc_link = NULL;
+    makecontext(ctx, entry, 0);
+}
+
+#endif
+
+struct task {
+    task_ctx_t   ctx;
+    void        *(*fn)(void *);
+    void        *arg;
+    char        *stack;        // mmap'd region, guard page included, or NULL
+    atomic_int   state;
+    struct task *next;
+};
+
+/*
+ * `runq_t` is the run queue of a worker. Workers pop from their own queue first and
+ * steal from the others when it is empty.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    task_t *head;
+    task_t *tail;
+} runq_t;
+
+typedef struct {
+    pthread_t  thread;
+    int        id;
+    runq_t     runq;
+    task_ctx_t sched_ctx;      // Context of the scheduler loop of this worker
+    task_t     *current;       // Task running on this worker
+    int        action;         // What to do with 'current' when it switches back
+} worker_t;
+
+static worker_t *workers = NULL;
+static int      nworkers = 0;
+
+/*
+ * Thread-local Variable: self
+ * ---------------------------
+ * The worker running on this thread, NULL on threads outside the runtime.
+ */
+static __thread worker_t *self = NULL;
+
+/*
+ * Global Variables: nready, nidle
+ * -------------------------------
+ * Runnable tasks in all the run queues and workers sleeping on idle_cond. A pusher
+ * increments nready before reading nidle and a sleeper increments nidle before
+ * reading nready, so one of them always sees the other.
+ */
+static atomic_int      nready;
+static atomic_int      nidle;
+static atomic_int      next_worker;
+static pthread_mutex_t idle_mutex;
+static pthread_cond_t  idle_cond;
+
+/*
+ * Global Variable: stopping
+ * -------------------------
+ * Set, with idle_mutex held, to make the workers return once their queues are
+ * empty. Only used when init_task_runtime fails after starting some of them.
+ */
+static atomic_int      stopping;
+
+/*
+ * Global Variables: live, live_mutex, live_cond
+ * ---------------------------------------------
+ * Number of tasks started and not yet finished, and the condition wait_tasks sleeps on.
+ */
+static atomic_int      live;
+static pthread_mutex_t live_mutex;
+static pthread_cond_t  live_cond;
+
+/*
+ * Global Variables: free_tasks
+ * ----------------------------
+ * Finished tasks ready for reuse. Task structures are never freed, so a late
+ * task_wake on a finished task is only a spurious wakeup.
+ */
+static task_t          *free_tasks = NULL;
+static int             free_stacks = 0;
+static pthread_mutex_t free_mutex;
+
+/*
+ * Function: current_worker
+ * ------------------------
+ * Reads the thread-local worker. It is never inlined, so code that resumed on
+ * another worker thread after a switch does not reuse a stale thread-local address.
+ */
+static __attribute__((noinline)) worker_t *current_worker(void) {
+    return self;
+}
+
+task_t *task_self(void) {
+    worker_t *w = current_worker();
+    return w ? w->current : NULL;
+}
+
+owner_t current_owner(void) {
+    task_t *task = task_self();
+    return task ? (owner_t)task : (owner_t)pthread_self();
+}
+
+/*
+ * Function: runq_push
+ * -------------------
+ * Appends a runnable task to a worker's run queue and wakes an idle worker if any.
+ */
+static void runq_push(worker_t *w, task_t *task) {
+    task->next = NULL;
+    pthread_mutex_lock(&(w->runq.mutex));
+    if (w->runq.tail)
+        w->runq.tail->next = task;
+    else
+        w->runq.head = task;
+    w->runq.tail = task;
+    pthread_mutex_unlock(&(w->runq.mutex));
+
+    ATOMIC_INC(&nready);
+    if (atomic_load(&nidle) > 0) {
+        pthread_mutex_lock(&idle_mutex);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_mutex);
+    }
+}
+
+/*
+ * Function: runq_pop
+ * ------------------
+ * Removes the oldest task from a worker's run queue, or returns NULL if it is empty.
+ */
+static task_t *runq_pop(worker_t *w) {
+    task_t *task;
+
+    pthread_mutex_lock(&(w->runq.mutex));
+    if ((task = w->runq.head) != NULL) {
+        w->runq.head = task->next;
+        if (!w->runq.head)
+            w->runq.tail = NULL;
+    }
+    pthread_mutex_unlock(&(w->runq.mutex));
+
+    if (task)
+        ATOMIC_DEC(&nready);
+    return task;
+}
+
+/*
+ * Function: next_task
+ * -------------------
+ * Picks the next task for a worker: from its own queue first, then stealing from the
+ * other workers' queues. Returns NULL if every queue is empty.
+ */
+static task_t *next_task(worker_t *w) {
+    task_t *task;
+    int i;
+
+    if ((task = runq_pop(w)) != NULL)
+        return task;
+    for (i = 1; i < nworkers; i++) {
+        if ((task = runq_pop(&workers[(w->id + i) % nworkers])) != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+/*
+ * Function: schedule
+ * ------------------
+ * Makes a task runnable on the calling worker, or on the next worker in round-robin
+ * order when called from outside the runtime.
+ */
+static void schedule(task_t *task) {
+    worker_t *w = current_worker();
+    if (!w)
+        w = &workers[(unsigned)ATOMIC_INC(&next_worker) % nworkers];
+    runq_push(w, task);
+}
+
+/*
+ * Function: alloc_task / recycle_task
+ * -----------------------------------
+ * Take a task from the free list (allocating one if it is empty), and give a finished
+ * task back. Stacks beyond TASK_STACK_CACHE are unmapped, the structure is kept.
+ */
+static task_t *alloc_task(void) {
+    task_t *task;
+    long page = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&free_mutex);
+    if ((task = free_tasks) != NULL) {
+        free_tasks = task->next;
+        if (task->stack)
+            free_stacks--;
+    }
+    pthread_mutex_unlock(&free_mutex);
+
+    if (!task && !(task = calloc(1, sizeof(task_t))))
+        return NULL;
+
+    if (!task->stack) {
+        task->stack = mmap(NULL, TASK_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (task->stack == MAP_FAILED) {
+            task->stack = NULL;
+            atomic_store(&(task->state), TASK_DEAD);
+            pthread_mutex_lock(&free_mutex);
+            task->next = free_tasks;
+            free_tasks = task;
+            pthread_mutex_unlock(&free_mutex);
+            return NULL;
+        }
+        mprotect(task->stack, page, PROT_NONE);
+    }
+    return task;
+}
+
+static void recycle_task(task_t *task) {
+    long page = sysconf(_SC_PAGESIZE);
+
+    atomic_store(&(task->state), TASK_DEAD);
+    pthread_mutex_lock(&free_mutex);
+    if (free_stacks < TASK_STACK_CACHE) {
+        free_stacks++;
+    } else {
+        munmap(task->stack, TASK_STACK_SIZE + page);
+        task->stack = NULL;
+    }
+    task->next = free_tasks;
+    free_tasks = task;
+    pthread_mutex_unlock(&free_mutex);
+}
+
+/*
+ * Function: task_switch
+ * ---------------------
+ * Switches from the running task back to its worker's scheduler, telling it what to
+ * do with the task. Returns when the task is resumed, maybe on another worker.
+ */
+static void task_switch(int action) {
+    worker_t *w = current_worker();
+    task_t *task = w->current;
+
+    w->action = action;
+    ctx_switch(&(task->ctx), &(w->sched_ctx));
+}
+
+/*
+ * Function: task_main
+ * -------------------
+ * Entry point of every task context: runs the task function and exits the task.
+ */
+static void task_main(void) {
+    task_t *task = task_self();
+    task->fn(task->arg);
+    task_switch(ACTION_EXIT);
+}
+
+void task_park(void) {
+    task_switch(ACTION_PARK);
+}
+
+void yield_task(void) {
+    if (task_self())
+        task_switch(ACTION_YIELD);
+}
+
+void task_wake(task_t *task) {
+    int state;
+
+    for (;;) {
+        state = atomic_load(&(task->state));
+        if (state == TASK_PARKED) {
+            if (atomic_compare_exchange_strong(&(task->state), &state, TASK_RUNNING)) {
+                schedule(task);
+                return;
+            }
+        } else if (state == TASK_RUNNING) {
+            if (atomic_compare_exchange_strong(&(task->state), &state, TASK_NOTIFIED))
+                return;
+        } else {
+            // Already notified, or finished: nothing to do
+            return;
+        }
+    }
+}
+
+/*
+ * Function: idle_wait
+ * -------------------
+ * Puts a worker to sleep until some run queue has a task.
+ */
+static void idle_wait(void) {
+    pthread_mutex_lock(&idle_mutex);
+    ATOMIC_INC(&nidle);
+    while (atomic_load(&nready) == 0 && !atomic_load(&stopping))
+        pthread_cond_wait(&idle_cond, &idle_mutex);
+    ATOMIC_DEC(&nidle);
+    pthread_mutex_unlock(&idle_mutex);
+}
+
+/*
+ * Function: worker_main
+ * ---------------------
+ * Scheduler loop of a worker thread. It switches to the next runnable task and, once
+ * the task switches back, requeues, parks or recycles it according to the action.
+ */
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    task_t *task;
+    int state;
+
+    self = w;
+    for (;;) {
+        if ((task = next_task(w)) == NULL) {
+            if (atomic_load(&stopping))
+                return NULL;
+            idle_wait();
+            continue;
+        }
+
+        w->current = task;
+        w->action = ACTION_YIELD;
+        ctx_switch(&(w->sched_ctx), &(task->ctx));
+        w->current = NULL;
+
+        switch (w->action) {
+        case ACTION_YIELD:
+            runq_push(w, task);
+            break;
+        case ACTION_PARK:
+            // The task context is saved now: it can be resumed by whoever wakes it.
+            // If it was notified while parking, it goes straight back to the queue.
+            state = TASK_RUNNING;
+            if (!atomic_compare_exchange_strong(&(task->state), &state, TASK_PARKED)) {
+                atomic_store(&(task->state), TASK_RUNNING);
+                runq_push(w, task);
+            }
+            break;
+        case ACTION_EXIT:
+            recycle_task(task);
+            if (ATOMIC_DEC(&live) == 0) {
+                pthread_mutex_lock(&live_mutex);
+                pthread_cond_broadcast(&live_cond);
+                pthread_mutex_unlock(&live_mutex);
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: stop_workers
+ * ----------------------
+ * Stops and joins the first 'started' workers, and releases the worker array, so
+ * that init_task_runtime can be called again after a failure.
+ */
+static void stop_workers(int started) {
+    int i;
+
+    pthread_mutex_lock(&idle_mutex);
+    atomic_store(&stopping, 1);
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_mutex);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    for (i = 0; i < nworkers; i++)
+        pthread_mutex_destroy(&(workers[i].runq.mutex));
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+    atomic_store(&stopping, 0);
+}
+
+/*
+ * Function: init_task_runtime
+ * ---------------------------
+ * Starts the task runtime with 'n' worker threads, or one per online CPU if n <= 0.
+ * Returns 0 on success, -1 if the runtime is already running or could not be started.
+ */
+int init_task_runtime(int n) {
+    int i;
+
+    if (workers)
+        return -1;
+    if (n <= 0)
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+        n = 1;
+
+    pthread_mutex_init(&idle_mutex, NULL);
+    pthread_cond_init(&idle_cond, NULL);
+    pthread_mutex_init(&live_mutex, NULL);
+    pthread_cond_init(&live_cond, NULL);
+    pthread_mutex_init(&free_mutex, NULL);
+    atomic_init(&nready, 0);
+    atomic_init(&nidle, 0);
+    atomic_init(&live, 0);
+    atomic_init(&next_worker, 0);
+    atomic_init(&stopping, 0);
+
+    if (!(workers = calloc(n, sizeof(worker_t))))
+        return -1;
+    nworkers = n;
+    for (i = 0; i < n; i++) {
+        workers[i].id = i;
+        pthread_mutex_init(&(workers[i].runq.mutex), NULL);
+    }
+    // The workers are detached only once they all started, so that a failure
+    // can join the ones already running
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&(workers[i].thread), NULL, worker_main, &workers[i]) != 0) {
+            stop_workers(i);
+            return -1;
+        }
+    }
+    for (i = 0; i < n; i++)
+        pthread_detach(workers[i].thread);
+    return 0;
+}
+
+/*
+ * Function: go_task
+ * -----------------
+ * Starts a new task running fn(arg). Returns 0 on success, -1 if the runtime is not
+ * running or the task could not be allocated.
+ */
+int go_task(void *(*fn)(void *), void *arg) {
+    task_t *task;
+
+    if (!workers || !(task = alloc_task()))
+        return -1;
+
+    task->fn = fn;
+    task->arg = arg;
+    ctx_make(&(task->ctx), task->stack + sysconf(_SC_PAGESIZE), TASK_STACK_SIZE, task_main);
+    atomic_store(&(task->state), TASK_RUNNING);
+
+    ATOMIC_INC(&live);
+    schedule(task);
+    return 0;
+}
+
+/*
+ * Function: wait_tasks
+ * --------------------
+ * Blocks the calling thread until every task started with go_task has returned.
+ * It must not be called from a task.
+ */
+void wait_tasks(void) {
+    pthread_mutex_lock(&live_mutex);
+    while (atomic_load(&live) > 0)
+        pthread_cond_wait(&live_cond, &live_mutex);
+    pthread_mutex_unlock(&live_mutex);
+}
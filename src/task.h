@@ -0,0 +1,60 @@
+/*
+ * File: task.h
+ * ----------------------------
+ * This header file includes the internal interface of the task runtime.
+ *
+ * The task runtime runs lightweight tasks (see go_task) on a fixed set of worker
+ * threads. A task that blocks on a channel parks itself and its worker switches to
+ * the next runnable task in user space, instead of blocking the whole thread.
+ *
+ * Functions:
+ * task_self: Returns the running task, or NULL when called outside the runtime.
+ * current_owner: Returns the identity used to reserve channel operations for a waiter.
+ * task_park: Parks the running task until task_wake is called for it.
+ * task_wake: Makes a parked task runnable again.
+ */
+#ifndef _LC_TASK_H
+#define _LC_TASK_H 1
+
+#include "waitq.h"
+
+typedef struct task task_t;
+
+/*
+ * Function: task_self
+ * -------------------
+ * Returns the task running on the calling thread, or NULL if the caller is a plain
+ * thread and not a task of the runtime.
+ */
+extern task_t *task_self(void);
+
+/*
+ * Function: current_owner
+ * -----------------------
+ * Returns the identity of the caller as a waiter: the running task if there is one,
+ * otherwise the calling thread. Tasks migrate between worker threads, so a channel
+ * operation reserved for a task must not be tied to the thread it blocked on.
+ */
+extern owner_t current_owner(void);
+
+/*
+ * Function: task_park
+ * -------------------
+ * Parks the running task and switches to the next runnable one. The task resumes
+ * (possibly on another worker thread) after task_wake is called for it. Wakeups
+ * may be spurious: callers must re-check their condition in a loop.
+ */
+extern void task_park(void);
+
+/*
+ * Function: task_wake
+ * -------------------
+ * Makes a parked task runnable. If the task has not parked yet, its next park
+ * returns immediately, so a wakeup is never lost.
+ *
+ * Parameters:
+ *    task - the task to wake.
+ */
+extern void task_wake(task_t *task);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include "waitq.h"
+#include "alloc.h"
 /* 
  * Function: enqueue
  * -----------------
@@ -15,7 +16,7 @@
  *    If the function fails to allocate memory for the new node, it returns -1.
  */
 int enqueue(waitq_t *waitq, condvar_t *ptrcv) {
-    waitq_node_t *new_node = malloc(sizeof(waitq_node_t));
+    waitq_node_t *new_node = lc_alloc(sizeof(waitq_node_t));
     if (!new_node) {
         return -1;
     }
@@ -31,7 +32,7 @@ int enqueue(waitq_t *waitq, condvar_t *ptrcv) {
         new_node->prev = waitq->tail;
     }
     waitq->tail = new_node;
-    waitq->len++;
+    __atomic_add_fetch(&(waitq->len), 1, __ATOMIC_SEQ_CST);
     return 0;
 }
 
@@ -61,10 +62,37 @@ condvar_t *dequeue(waitq_t *waitq) {
         } else {
             waitq->tail = NULL;
         }
-        waitq->len--;
-        free(head);
+        __atomic_sub_fetch(&(waitq->len), 1, __ATOMIC_SEQ_CST);
+        lc_free(head, sizeof(waitq_node_t));
     }
     return ptrcv;
 }
 
+/* 
+ * Function: waitq_remove
+ * ----------------------
+ * This function unlinks a node from anywhere in the queue passed as an argument
+ * and frees it.
+ * 
+ * Parameters:
+ *    waitq - a pointer to the queue the node belongs to.
+ *    node - a pointer to the node to remove.
+ * 
+ * Returns:
+ *    The `condvar_t` pointer that was stored in the node.
+ */
+condvar_t *waitq_remove(waitq_t *waitq, waitq_node_t *node) {
+    condvar_t *ptrcv = node->ptrcv;
 
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        waitq->head = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        waitq->tail = node->prev;
+    __atomic_sub_fetch(&(waitq->len), 1, __ATOMIC_SEQ_CST);
+    lc_free(node, sizeof(waitq_node_t));
+    return ptrcv;
+}
@@ -3,17 +3,34 @@
 
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * `owner_t` identifies who is waiting on a channel: the running task when called
+ * from the task runtime, the calling thread otherwise. 0 means nobody.
+ */
+typedef uintptr_t owner_t;
+
+struct task;
+struct chan_async;
 
 /* 
  * `condvar_t` is a structure that bundles a condition variable and a mutex, 
  * along with a boolean indicating whether it's a select operation, and a channel descriptor.
+ * A thread that also waits on file descriptors parks on its eventfd (`efd`) instead of `pcond`,
+ * and a task of the task runtime parks in user space (`task`) instead of blocking its worker.
+ * An asynchronous operation (`async`) does not park at all: its continuation is run instead.
  */
-typedef struct {
+typedef struct condvar {
     pthread_cond_t  pcond;    // Condition variable for thread synchronization.
     pthread_mutex_t mutex;       // Mutex to ensure mutual exclusion.
-    pthread_t  thread;
+    owner_t    owner;            // Identity of the waiter, see `current_owner`.
     atomic_int ref;
     atomic_int cd;
+    int        efd;              // Parker eventfd of the waiting thread, or -1 to use pcond.
+    struct task *task;           // Waiting task, or NULL if the waiter is a thread.
+    struct chan_async *async;    // Asynchronous operation to complete, or NULL.
+    struct condvar *next_wake;   // Next entry of the deferred wakeups of the waker thread.
 } condvar_t;
 
 /* 
@@ -29,6 +46,9 @@ typedef struct waitq_node {
 /* 
  * `waitq_t` is a structure representing a doubly linked queue. 
  * It contains a counter of the queue's length and pointers to the head and tail nodes.
+ * The queue is changed under the lock of its channel, but the lock-free fast paths
+ * read 'len' without it (see select_fast_op), so the counter is updated with atomic
+ * operations.
  */
 typedef struct waitq {
     int len;                     // Length of the queue.
@@ -67,4 +87,19 @@ extern condvar_t *dequeue(waitq_t *waitq);
  */
 extern int enqueue(waitq_t *waitq, condvar_t *ptrcv);
 
+/* 
+ * Function: waitq_remove
+ * ----------------------
+ * This function unlinks a node from anywhere in the queue passed as an argument
+ * and frees it.
+ * 
+ * Parameters:
+ *    waitq - a pointer to the queue the node belongs to.
+ *    node - a pointer to the node to remove.
+ * 
+ * Returns:
+ *    The `condvar_t` pointer that was stored in the node.
+ */
+extern condvar_t *waitq_remove(waitq_t *waitq, waitq_node_t *node);
+
 #endif